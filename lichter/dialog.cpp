@@ -534,6 +534,12 @@ Dialog::Dialog(QWidget *parent) :
     port = new QSerialPort(this);
     port->setBaudRate(500000);
     port->setStopBits(QSerialPort::TwoStop);
+    connect(
+        port, SIGNAL(readyRead()),
+        this, SLOT(portReadyRead())
+    );
+    vacancy = 0;
+    frameCount = 0;
     //port->setBaudRate(QSerialPort::Baud115200);
     //port->setBaudRate(QSerialPort::Baud19200);
     //port->setBaudRate(QSerialPort::Baud9600);
@@ -745,7 +751,11 @@ void Dialog::connectToggled(bool checked)
 
     if (checked) {
         port->setPortName(portName);
-        if (port->open(QIODevice::WriteOnly)) {
+        if (port->open(QIODevice::ReadWrite)) {
+            answer.clear();
+            vacancy = 0;
+            acknowledged.invalidate();
+            portFrame.clear();
             portComboBox->setEnabled(false);
             leds.resize(ledsSpinBox->value());
             segment.resize(leds.count());
@@ -774,6 +784,7 @@ void Dialog::fileToggled(bool checked)
     if (checked) {
         file->setFileName(fileName);
         if (file->open(QIODevice::Append)) {
+            fileFrame.clear();
             fileEdit->setEnabled(false);
         }
         else {
@@ -1024,6 +1035,103 @@ QByteArray compr(const QByteArray &a)
     return compressed;
 }
 
+static void span(QDataStream &s, quint8 kind, int n)
+{
+    if (n < 64) {
+        s << quint8((kind << 6) | (n - 1));
+    }
+    else {
+        s << quint8((kind << 6) | 0x3F);
+        s << quint8(((n - 64) >> 8) & 0xFF);
+        s << quint8((n - 64) & 0xFF);
+    }
+}
+
+static int hash(const uchar *p)
+{
+    /* Hash of three bytes, indexing 4096 chains */
+    return ((p[0] << 4) ^ (p[1] << 2) ^ p[2]) & 0xFFF;
+}
+
+QByteArray delta(const QByteArray &a, const QByteArray &previous)
+{
+    /* Encode a frame as spans copied from the previous frame, literal spans
+    and spans repeating earlier bytes of the frame.
+    Repeats are looked up through the last positions that began with the same
+    three bytes, which are chained by their hash. Only the first few of them
+    within the reach of a distance are tried. */
+    QByteArray encoded;
+    QDataStream s(&encoded, QIODevice::WriteOnly);
+
+    const int max = 64 + 0xFFFF;
+    const int reach = 256;
+    const int tries = 32;
+    const int n = a.count();
+    const uchar *p = reinterpret_cast<const uchar *>(a.constData());
+
+    QVector<int> head(0x1000, -1);
+    QVector<int> chain(n, -1);
+    int hashed = 0;
+
+    int literal = 0;
+    int i = 0;
+    while (i < n) {
+        int copy = 0;
+        while (i + copy < n && i + copy < previous.count() && a.at(i + copy) == previous.at(i + copy))
+            copy++;
+
+        for (; hashed < i && hashed + 2 < n; hashed++) {
+            const int h = hash(&p[hashed]);
+            chain[hashed] = head[h];
+            head[h] = hashed;
+        }
+
+        int match = 0;
+        int distance = 0;
+        if (i + 2 < n) {
+            int t = 0;
+            for (int j = head[hash(&p[i])]; j >= 0 && i - j <= reach && t < tries; j = chain[j], t++) {
+                int m = 0;
+                while (i + m < n && p[i + m] == p[j + m])
+                    m++;
+                if (m > match) {
+                    match = m;
+                    distance = i - j;
+                }
+            }
+        }
+
+        if (copy >= 2 || match >= 4 || i - literal == max) {
+            if (literal < i) {
+                span(s, 1, i - literal);
+                s.writeRawData(a.constData() + literal, i - literal);
+            }
+
+            if (match >= 4 && match > copy) {
+                span(s, 2, qMin(match, max));
+                s << quint8(distance - 1);
+                i += qMin(match, max);
+            }
+            else if (copy >= 2) {
+                span(s, 0, qMin(copy, max));
+                i += qMin(copy, max);
+            }
+
+            literal = i;
+        }
+        else {
+            i++;
+        }
+    }
+
+    if (literal < i) {
+        span(s, 1, i - literal);
+        s.writeRawData(a.constData() + literal, i - literal);
+    }
+
+    return encoded;
+}
+
 QColor discretize(const QColor &color, qreal threshold)
 {
     const qreal min = qMin(color.redF(), qMin(color.greenF(), color.blueF()));
@@ -1038,7 +1146,7 @@ QColor discretize(const QColor &color, qreal threshold)
     return color;
 }
 
-void Dialog::emitFrame(QDataStream &stream)
+void Dialog::emitFrame(QDataStream &stream, QByteArray &previous)
 {
     QByteArray a;
     {
@@ -1060,15 +1168,29 @@ void Dialog::emitFrame(QDataStream &stream)
     }
 
     QByteArray c;
+    quint8 type;
     if (compressCheckBox->isChecked()) {
         c = compr(a);
-        stream << quint8(0xC9) << quint8(0xCA);
+        type = 0xCA;
+
+        /* Encode relative to the previous frame where that is shorter, with a
+        complete frame every now and then for the controller to catch on */
+        if (previous.count() == a.count() && frameCount % 50) {
+            const QByteArray d = delta(a, previous);
+            if (d.count() < c.count()) {
+                c = d;
+                type = 0xCD;
+            }
+        }
     }
     else {
         c = a;
-        stream << quint8(0xC9) << quint8(0xDA);
+        type = 0xDA;
     }
 
+    previous = a;
+    stream << quint8(0xC9) << type;
+
     const int length = c.length();
     stream << quint8((length >> 8) & 0xFF);
     stream << quint8(length & 0xFF);
@@ -1076,6 +1198,55 @@ void Dialog::emitFrame(QDataStream &stream)
     stream << quint8(0x36);
 }
 
+void Dialog::emitCommand(QDataStream &stream, const QByteArray &command)
+{
+    const int length = command.length();
+    stream << quint8(0xC9) << quint8(0xC0);
+    stream << quint8((length >> 8) & 0xFF);
+    stream << quint8(length & 0xFF);
+    stream.writeRawData(command.constData(), command.count());
+    stream << quint8(0x36);
+}
+
+void Dialog::portReadyRead()
+{
+    /* Answers from the controller. Every rendered frame is acknowledged with
+    the number of frames it can take in. */
+    answer.append(port->readAll());
+    for (;;) {
+        const int start = answer.indexOf(char(0xC9));
+        if (start < 0) {
+            answer.clear();
+            break;
+        }
+
+        answer.remove(0, start);
+        if (answer.length() < 5)
+            break;
+
+        const quint8 type = answer.at(1);
+        const int length = (quint8(answer.at(2)) << 8) | quint8(answer.at(3));
+        if ((type != 0xAC && type != 0xAD) || length > 8) {
+            answer.remove(0, 1);
+            continue;
+        }
+
+        if (answer.length() < 4 + length + 1)
+            break;
+
+        if (quint8(answer.at(4 + length)) == 0x36) {
+            if (type == 0xAD && length >= 1) {
+                vacancy = quint8(answer.at(4));
+                acknowledged.start();
+            }
+            answer.remove(0, 4 + length + 1);
+        }
+        else {
+            answer.remove(0, 1);
+        }
+    }
+}
+
 void Dialog::emitFrame()
 {
     /*if (!leds.isEmpty()) {
@@ -1100,16 +1271,31 @@ void Dialog::emitFrame()
     }
 
     if (port->isOpen()) {
-        if (port->bytesToWrite() == 0) {
+        /* Pace the frames on the acknowledges of the controller. Without
+        any, e.g. until it has caught on to the stream, keep asking for them
+        along with the frames. */
+        if (vacancy > 0) {
+            vacancy--;
             QDataStream stream(port);
-            emitFrame(stream);
+            emitFrame(stream, portFrame);
+        }
+        else if ((!acknowledged.isValid() || acknowledged.hasExpired(250)) && port->bytesToWrite() == 0) {
+            /* Frames may get lost, so do not refer to them */
+            portFrame.clear();
+
+            QDataStream stream(port);
+            emitCommand(stream, QByteArray("\x01\x01", 2));
+            emitFrame(stream, portFrame);
+            portFrame.clear();
         }
     }
 
     if (file->isOpen()) {
         QDataStream stream(file);
-        emitFrame(stream);
+        emitFrame(stream, fileFrame);
     }
+
+    frameCount++;
 }
 
 void Dialog::scene()
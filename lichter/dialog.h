@@ -3,6 +3,8 @@
 #define DIALOG_H
 
 #include <QtCore/QVector>
+#include <QtCore/QByteArray>
+#include <QtCore/QElapsedTimer>
 #include <QtGui/QColor>
 
 #include "ui_dialog.h"
@@ -72,6 +74,12 @@ private:
     QTimer *frameTimer;
     QTimer *sceneTimer;
     QTimer *dimTimer;
+    QByteArray answer;
+    QElapsedTimer acknowledged;
+    int vacancy;
+    QByteArray portFrame;
+    QByteArray fileFrame;
+    int frameCount;
     QVector<QColor> leds;
     QVector<QColor> segment;
 
@@ -86,6 +94,8 @@ private:
 
     friend class AbstractMode;
 
+    void emitCommand(QDataStream &stream, const QByteArray &command);
+
 private slots:
     void connectToggled(bool checked);
     void fileToggled(bool checked);
@@ -97,7 +107,8 @@ private slots:
     void positionChanged(int value);
     void dimToggled(bool checked);
     void emitFrame();
-    void emitFrame(QDataStream &stream);
+    void emitFrame(QDataStream &stream, QByteArray &previous);
+    void portReadyRead();
     void scene();
 
     void loadSettings(QAction *action);
@@ -80,8 +80,14 @@ public:
         case Tpm2Role:
             return envelope(0xDA, frames.at(index.row()));
 
-        case Tpz2Role:
-            return envelope(0xCA, compress(frames.at(index.row())));
+        case Tpz2Role: {
+            const QByteArray &frame = frames.at(index.row());
+            const QByteArray compressed = compress(frame);
+            const QByteArray indexed = palettize(frame);
+            if (!indexed.isNull() && indexed.count() < compressed.count())
+                return envelope(0xCB, indexed);
+            return envelope(0xCA, compressed);
+        }
 
         default:
             return QVariant();
@@ -180,6 +186,36 @@ private:
 
         return compressed;
     }
+
+    QByteArray palettize(const QByteArray &a) const
+    {
+        /* Palette and one index per LED, unless there are too many colours */
+        if (a.count() % 3)
+            return QByteArray();
+
+        QVector<QByteArray> colours;
+        QByteArray indices;
+        for (int i = 0; i < a.count(); i += 3) {
+            const QByteArray c = a.mid(i, 3);
+            int j = colours.indexOf(c);
+            if (j < 0) {
+                if (colours.count() == 64)
+                    return QByteArray();
+
+                j = colours.count();
+                colours.append(c);
+            }
+
+            indices.append((char) j);
+        }
+
+        QByteArray palettized;
+        palettized.append((char) colours.count());
+        for (const QByteArray &c: colours)
+            palettized.append(c);
+        palettized.append(indices);
+        return palettized;
+    }
 };
 
 
@@ -15,7 +15,111 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+/** Input buffer.
+Writers mark the blocks of the buffer whose content has changed in the dirty
+bitmap, so that rendering can skip LEDs whose input is the same as in the last
+frame. The bitmap is cleared once the frame has been rendered.
+
+If the maps read only the lower half of the buffer it is split into two halves.
+The decoders then write one half while the maps read the other one, and a
+complete frame is handed over by swapping the halves. Writers compare against
+the half being read, which holds the frame rendered last, so the dirty bitmap
+of the written half tracks the changes to that frame.
+*/
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cmsis/stm32f10x.h"
+
 #include "buffer.h"
 
-uint8_t buffer[MAXBUFF];
+#if MAXBUFF % 8
+#   error Input buffer halves not word aligned
+#endif
+
+uint8_t buffer[MAXBUFF] __ALIGNED(4);
+static uint32_t dirty[2][(MAXBLOCKS + 31) / 32];
+
+uint8_t *wbuf = buffer;
+uint8_t *rbuf = buffer;
+uint32_t *wdirty = dirty[0];
+uint32_t *rdirty = dirty[0];
+uint16_t nbuf = MAXBUFF;
+
+void buf_touch(uint16_t begin, uint16_t end)
+{
+    /* Mark all blocks in the range of [begin, end) */
+    if (end > nbuf)
+        end = nbuf;
+
+    for (uint16_t b = begin / BUFBLOCK; b * BUFBLOCK < end; b++)
+        wdirty[b / 32] |= UINT32_C(1) << (b % 32);
+}
+
+void buf_copy(uint16_t offset, const uint8_t *src, uint16_t n)
+{
+    /* Copy block by block, marking only the blocks that actually differ */
+    uint8_t *dst = &wbuf[offset];
+    const uint8_t *cmp = &rbuf[offset];
+    while (n) {
+        uint16_t k = BUFBLOCK - (offset % BUFBLOCK);
+        if (k > n)
+            k = n;
+
+        if (memcmp(cmp, src, k))
+            buf_touch(offset, offset + k);
+        memcpy(dst, src, k);
+
+        dst += k;
+        cmp += k;
+        src += k;
+        offset += k;
+        n -= k;
+    }
+}
+
+void buf_clean(void)
+{
+    memset(rdirty, 0, sizeof(*dirty));
+}
+
+void buf_split(bool split)
+{
+    if (split == (wbuf != rbuf))
+        return;
+
+    if (split) {
+        /* Both halves start out with the same frame */
+        nbuf = MAXBUFF / 2;
+        wbuf = buffer;
+        rbuf = &buffer[MAXBUFF / 2];
+        wdirty = dirty[0];
+        rdirty = dirty[1];
+        memcpy(rbuf, wbuf, nbuf);
+    }
+    else {
+        nbuf = MAXBUFF;
+        wbuf = rbuf = buffer;
+        wdirty = rdirty = dirty[0];
+    }
+
+    memset(dirty, 0, sizeof(dirty));
+}
+
+void buf_swap(void)
+{
+    /* Hand the written half over to the maps */
+    if (wbuf == rbuf)
+        return;
+
+    uint8_t *p = wbuf;
+    wbuf = rbuf;
+    rbuf = p;
 
+    uint32_t *d = wdirty;
+    wdirty = rdirty;
+    rdirty = d;
+    memset(wdirty, 0, sizeof(*dirty));
+}
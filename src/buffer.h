@@ -19,10 +19,30 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define BUFFER_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
-/* Input buffer size */
+/* Input buffer size, a multiple of eight to keep both halves word aligned */
 #define MAXBUFF 3000
 
+/* Size of the blocks that are tracked for changes */
+#define BUFBLOCK 32
+#define MAXBLOCKS ((MAXBUFF + BUFBLOCK - 1) / BUFBLOCK)
+
 extern uint8_t buffer[MAXBUFF];
 
+/* Buffer written by the decoders and buffer read by the maps, along with their
+dirty bitmaps and their size */
+extern uint8_t *wbuf;
+extern uint8_t *rbuf;
+extern uint32_t *wdirty;
+extern uint32_t *rdirty;
+extern uint16_t nbuf;
+
+void buf_touch(uint16_t begin, uint16_t end);
+void buf_copy(uint16_t offset, const uint8_t *src, uint16_t n);
+void buf_clean(void);
+
+void buf_split(bool split);
+void buf_swap(void);
+
 #endif
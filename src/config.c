@@ -58,6 +58,7 @@ struct config_t config = {
         .red = 0xFF,
         .green = 0xFF,
         .blue = 0xFF,
+        .gamma = 10,
 
         .map = {
             [0] = {
@@ -81,6 +82,7 @@ static int ch0;
 static FATFS fs;
 static FIL index;
 static size_t line;
+static char *failure;
 
 static void ungetch(int ch)
 {
@@ -122,6 +124,7 @@ static void seek(FSIZE_t p)
 }
 
 static bool fail(char *s);
+static void report(void);
 #define FAIL(s)     fail(s)
 
 #define EXPECT(x)   \
@@ -142,6 +145,7 @@ static const char *const keywords[] =
     "fdev",
     "framerate",
     "frequency",
+    "gamma",
     "leds",
     "length",
     "listen",
@@ -186,6 +190,7 @@ enum token_t
     tok_keyword_fdev,
     tok_keyword_framerate,
     tok_keyword_frequency,
+    tok_keyword_gamma,
     tok_keyword_leds,
     tok_keyword_length,
     tok_keyword_listen,
@@ -534,8 +539,9 @@ static bool read_color(uint8_t *r, uint8_t *g, uint8_t *b)
     return true;
 }
 
-static bool read_range(uint16_t *restrict begin, uint16_t *restrict end, int8_t *restrict step, uint16_t max)
+static bool read_range(uint16_t *restrict begin, uint16_t *restrict end, int8_t *restrict step, uint16_t last, uint16_t max)
 {
+    /* '$' refers to last unless the range begins beyond it */
     int32_t i;
     if (getch() != '[')
         return FAIL("Expected '['");
@@ -564,7 +570,7 @@ static bool read_range(uint16_t *restrict begin, uint16_t *restrict end, int8_t
         /* Range */
         while (isspace(ch = getch()));
         if (ch == '$') {
-            e = max;
+            e = (b > last) ? max : last;
         }
         else {
             ungetch(ch);
@@ -646,7 +652,7 @@ static bool map_statement(void *p)
 
     EXPECT(tok_colon);
     EXPECT(tok_range);
-    if (!read_range(&map.begin, &map.end, &map.step, MAXLEDS-1))
+    if (!read_range(&map.begin, &map.end, &map.step, MAXLEDS-1, MAXLEDS-1))
         return FAIL("Invalid string range");
 
     EXPECT(tok_assign);
@@ -667,7 +673,7 @@ static bool map_statement(void *p)
         EXPECT(tok_lparen);
         tok = token();
         if (tok == tok_range) {
-            if (!read_range(&map.red.begin, &map.red.end, &map.red.step, MAXBUFF-1))
+            if (!read_range(&map.red.begin, &map.red.end, &map.red.step, MAXBUFF-1, MAXFRAME-1))
                 return FAIL("Invalid red range for map");
         }
         else if (tok == tok_int) {
@@ -683,7 +689,7 @@ static bool map_statement(void *p)
         EXPECT(tok_comma);
         tok = token();
         if (tok == tok_range) {
-            if (!read_range(&map.green.begin, &map.green.end, &map.green.step, MAXBUFF-1))
+            if (!read_range(&map.green.begin, &map.green.end, &map.green.step, MAXBUFF-1, MAXFRAME-1))
                 return FAIL("Invalid green range for map");
         }
         else if (tok == tok_int) {
@@ -699,7 +705,7 @@ static bool map_statement(void *p)
         EXPECT(tok_comma);
         tok = token();
         if (tok == tok_range) {
-            if (!read_range(&map.blue.begin, &map.blue.end, &map.blue.step, MAXBUFF-1))
+            if (!read_range(&map.blue.begin, &map.blue.end, &map.blue.step, MAXBUFF-1, MAXFRAME-1))
                 return FAIL("Invalid blue range for map");
         }
         else if (tok == tok_int) {
@@ -774,7 +780,7 @@ static bool leds_statement(void *p)
     case tok_keyword_framerate:
         EXPECT(tok_colon);
         EXPECT(tok_int);
-        if (!read_int(&i, 0, 30))
+        if (!read_int(&i, 0, MAXFPS))
             return FAIL("Invalid framerate");
         config.leds.framerate = i;
         break;
@@ -789,6 +795,14 @@ static bool leds_statement(void *p)
         config.leds.blue = b;
         break;
 
+    case tok_keyword_gamma:
+        EXPECT(tok_colon);
+        EXPECT(tok_int);
+        if (!read_int(&i, 10, 30))
+            return FAIL("Invalid gamma");
+        config.leds.gamma = i;
+        break;
+
     default:
         return FAIL("Unknown statement in leds block");
     }
@@ -892,10 +906,12 @@ static bool scene_statement(void *p)
     int32_t i;
     uint8_t r, g, b;
     uint8_t n;
-    char buf[256];
+    char buf[2 * (FF_MAX_LFN + 1)];
 
     case tok_string:
-        read_string(buf, sizeof(buf)/sizeof(*buf));
+        if (!read_string(buf, sizeof(buf)/sizeof(*buf)))
+            return false;
+
         if (run)
             sc_do_tpm2(buf);
         break;
@@ -920,7 +936,7 @@ static bool scene_statement(void *p)
     case tok_keyword_framerate:
         EXPECT(tok_colon);
         EXPECT(tok_int);
-        if (!read_int(&i, 0, 30))
+        if (!read_int(&i, 0, MAXFPS))
             return FAIL("Invalid framerate");
 
         if (run)
@@ -997,6 +1013,7 @@ static bool read_mode(void)
     static const char *const modes[] = {
         "beacon",
         "dmx",
+        "record",
         "rx",
         "scene",
         "standalone",
@@ -1098,6 +1115,7 @@ void cfg_map(FSIZE_t map_)
     led_clear();
     seek(map_);
     read_block(&map_statement, 0);
+    report();
 }
 
 
@@ -1116,12 +1134,15 @@ FSIZE_t cfg_scene(uint16_t scene)
             return 0;
 
         seek(config.mode.mode_);
-        if (read_block(&mode_statement, &scene))
+        const bool none = read_block(&mode_statement, &scene);
+        report();
+        if (none)
             /* Parsed through all the scenes without match */
             return 0;
     }
 
     tok = token();
+    report();
     return (tok == tok_lbrace) ? tell() : 0;
 }
 
@@ -1136,13 +1157,32 @@ FSIZE_t cfg_command(FSIZE_t s)
         return 0;
 
     bool run = true;
-    scene_statement(&run);
+    if (!failure)
+        scene_statement(&run);
+
+    if (failure) {
+        report();
+        return 0;
+    }
+
     return tell();
 }
 
 
 static bool fail(char *s)
 {
+    /* Reported by the entry points, to keep it off the stack of the parser */
+    if (!failure)
+        failure = s;
+
+    return false;
+}
+
+static void report(void)
+{
+    if (!failure)
+        return;
+
     f_close(&index);
     if (f_open(&index, "index.txt", FA_WRITE | FA_OPEN_APPEND) == FR_OK) {
         /* Sanity to prevent flooding */
@@ -1166,7 +1206,7 @@ static bool fail(char *s)
 
         f_puts(l, &index);
         f_puts(": ", &index);
-        f_puts(s, &index);
+        f_puts(failure, &index);
         f_puts(
             "\n"
             "        \\\n"
@@ -1182,7 +1222,7 @@ static bool fail(char *s)
         f_close(&index);
     }
 
-    return false;
+    failure = 0;
 }
 
 
@@ -1193,6 +1233,7 @@ void cfg_prepare(void)
     if (mount()) {
         if (f_open(&index, "index.txt", FA_READ) == FR_OK) {
             if (!parse()) {
+                report();
                 config.mode.mode = no_mode;
                 panic();
             }
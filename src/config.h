@@ -48,6 +48,7 @@ struct config_t
         uint8_t red;
         uint8_t green;
         uint8_t blue;
+        uint8_t gamma;
 
         struct led_map_t map[16];
 
@@ -60,6 +61,7 @@ struct config_t
 
             beacon_mode,
             dmx_mode,
+            record_mode,
             rx_mode,
             scene_mode,
             standalone_mode,
@@ -16,16 +16,25 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 /** DMX input.
-DMX universes are continuously received and written to the input buffer,
-starting at an offset of MAXDMX. This is considered the intermediate DMX buffer.
-At the end of each universe the intermediate buffer is copied at once to the
-input buffer, starting at the very beginning. This is done only if the trip is
-clear; it will be set in turn.
+Universes are received by DMA, see tty.c. The break preceding every universe
+shows up as a framing error, upon which the DMA is directed to receive the start
+code. If that is zero the DMA is directed to receive the slots straight into
+the universe buffer, otherwise the packet is ignored until the next break. The
+universe is handed over at the next break, or once all MAXDMX slots have been
+received.
+If the input buffer is split into halves the written half serves as universe
+buffer, so handing over merely swaps the halves. Otherwise universes are received
+into two intermediate buffers in turn, starting at an offset of MAXDMX, and the
+completed one is copied to the beginning of the input buffer by dmx_trip(). This
+is done only if the trip is clear; it will be set in turn.
 This is to avoid flicker due to incomplete universes being rendered.
+If DMA is not available the data is copied to the universe buffer as it is
+received instead.
 */
 
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 
 #include "cmsis/stm32f10x.h"
@@ -40,44 +49,99 @@ This is to avoid flicker due to incomplete universes being rendered.
 
 #define DMX_START               0x00
 
-#if MAXBUFF < 2*MAXDMX
-#   error MAXBUFF must be twice as big as MAXDMX
+#if MAXBUFF < 3*MAXDMX
+#   error MAXBUFF must be three times as big as MAXDMX
 #endif
 
 
 static timeout_t timeout;
 static uint16_t index;
+static uint8_t code;
+static uint8_t *target;
+static uint8_t *volatile ready;
 
 static volatile bool trip;
 static volatile bool trap;
+static bool sensing;
+static bool foreign;
 
-static void digester(uint32_t status, uint8_t ch)
+static void complete(void)
 {
-    if (status & (USART_SR_FE | USART_SR_NE)) {
-        /* Assume break */
-        index = 0;
+    /* Hand over a universe unless the last one has not been rendered yet */
+    if (index < 2 || index > MAXDMX + 1 || trip)
+        return;
+
+    if (wbuf != rbuf) {
+        buf_touch(0, index - 1);
+        buf_swap();
     }
     else {
-        if (!index) {
-            if (ch == DMX_START) {
-                trap = true;
-                if (!trip) {
-                    memcpy(&buffer[0], &buffer[MAXDMX], MAXDMX);
-                    trip = true;
-                }
-            }
-            else {
-                index = MAXDMX;
-            }
+        ready = target;
+        target = (target == &buffer[MAXDMX]) ? &buffer[2 * MAXDMX] : &buffer[MAXDMX];
+    }
+
+    trip = true;
+}
+
+static void digester(uint32_t status, const uint8_t *data, size_t n)
+{
+    /* An error refers to the last byte */
+    const bool error = status & (USART_SR_FE | USART_SR_NE);
+    if (error && n)
+        n--;
+
+    if (n && !index) {
+        if (*data == DMX_START) {
+            trap = true;
+            if (wbuf != rbuf)
+                target = wbuf;
+            index = 1;
+            tty_direct(target, MAXDMX);
         }
-        else if (index < MAXDMX) {
-            buffer[MAXDMX + index] = ch;
+        else {
+            /* Ignore alternate start codes */
+            index = MAXDMX + 1;
+            tty_direct(0, 0);
         }
+
+        data++;
+        n--;
+    }
+
+    if (n && index <= MAXDMX) {
+        /* Channels, in place if received by DMA */
+        const uint16_t room = MAXDMX + 1 - index;
+        if (n > room)
+            n = room;
+
+        uint8_t *p = &target[index - 1];
+        if (data != p)
+            memcpy(p, data, n);
+        index += n;
+
+        if (index > MAXDMX)
+            complete();
+    }
+
+    if (error) {
+        /* Assume break */
+        if (index <= MAXDMX)
+            complete();
+
+        index = 0;
+        tty_direct(&code, 1);
     }
 }
 
 bool dmx_trip(void)
 {
+    /* Copy a universe that has been received into an intermediate buffer */
+    uint8_t *p = ready;
+    if (p) {
+        buf_copy(0, p, MAXDMX);
+        ready = 0;
+    }
+
     return trip;
 }
 
@@ -90,7 +154,11 @@ void dmx_enable(bool enable)
 {
     trip = false;
     trap = false;
-    index = MAXDMX;
+    ready = 0;
+    target = &buffer[MAXDMX];
+    index = MAXDMX + 1;
+    sensing = false;
+    foreign = false;
     timeout = tot_set(DMX_TIMEOUT);
 
     if (enable) {
@@ -113,9 +181,28 @@ bool dmx_detect(void)
         return true;
     }
 
+    /* Sense whether the source is DMX at all */
+    uint32_t baud;
+    bool brk;
+    if (!sensing) {
+        tty_sense();
+        sensing = true;
+    }
+    else if (tty_sensed(&baud, &brk)) {
+        sensing = false;
+        foreign = !brk;
+        timeout = tot_set(DMX_TIMEOUT);
+    }
+
     return false;
 }
 
+bool dmx_tpm2(void)
+{
+    /* Plain UART frames without breaks have been sensed on the line */
+    return foreign;
+}
+
 void dmx_prepare(void)
 {
 
@@ -27,6 +27,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 void dmx_enable(bool enable);
 bool dmx_detect(void);
+bool dmx_tpm2(void);
 
 bool dmx_trip(void);
 void dmx_clear(void);
@@ -320,11 +320,12 @@ bool hnd_wake(uint8_t id)
 }
 
 
-bool hnd_ping(uint8_t id, uint16_t *vbat, int16_t *rssi, int16_t *temp)
+bool hnd_ping(uint8_t id, uint16_t *vbat, int16_t *rssi, int16_t *temp,
+              uint8_t *depth, uint8_t *reserve, uint16_t *underruns)
 {
     uint8_t length = pack("!", HND_PING);
     rf_sendto(id, msg, length);
-    return rcvack(id, &length) && unpack(length, "Www", vbat, rssi, temp);
+    return rcvack(id, &length) && unpack(length, "WwwCCW", vbat, rssi, temp, depth, reserve, underruns);
 }
 
 
@@ -424,13 +425,16 @@ bool hnd_handle(void)
         return false;
 
     switch (msg[0]) {
-    case HND_PING:
+    case HND_PING: {
         if (!unpack(length, "!"))
             return false;
 
-        length = pack("Www", ad_vbat(), rf_rssi(), ad_temp());
+        uint8_t depth, reserve;
+        uint16_t underruns;
+        sc_statistics(&depth, &reserve, &underruns);
+        length = pack("WwwCCW", ad_vbat(), rf_rssi(), ad_temp(), depth, reserve, underruns);
         sndack(length);
-        break;
+        } break;
 
     case HND_START: {
         uint16_t scene;
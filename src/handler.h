@@ -27,7 +27,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 bool hnd_sleep(uint8_t id);
 bool hnd_wake(uint8_t id);
 
-bool hnd_ping(uint8_t id, uint16_t *vbat, int16_t *rssi, int16_t *temp);
+bool hnd_ping(uint8_t id, uint16_t *vbat, int16_t *rssi, int16_t *temp,
+              uint8_t *depth, uint8_t *reserve, uint16_t *underruns);
 
 bool hnd_start(uint8_t id, uint16_t scene);
 bool hnd_pause(uint8_t id);
@@ -37,6 +37,67 @@ generate a '1' bit.
 After the DMA complete timer 3 is reconfigured in one pulse mode to expire after
 the reset duration.
 
+The 'bits' array is split into two planes if the string length permits so. The
+DMA then clocks out the front plane while the next frame is rendered into the
+back plane, and led_universe() merely swaps the planes by reloading the memory
+address of DMA1 channel 2. Longer strings fall back to a single plane, in which
+case rendering has to wait for the DMA to complete.
+As frames are rendered on top of the previous one, the back plane is brought up
+to date when it is captured. Only the range of LEDs rendered into the frame that
+has been swapped to the front is copied for this.
+A universe that is released while the previous one is still being clocked out
+is deferred until the end of the reset duration, signalled by the timer 3 update
+interrupt.
+
+If LED_RING is defined the 'bits' array is replaced by a ring of only 2*RING
+LEDs that DMA1 channel 2 runs through in circular mode. Its half transfer and
+transfer complete interrupts re-encode the half that has just been clocked out
+with the next LEDs from the pixel pool. The pool keeps the three color bytes of
+every LED, with the strings laid out one after another, so the number of
+strings that fit into the pool depends on the string length. The interrupt
+preempts all others so as not to miss its deadline, see sys_prepare().
+Rendering has to wait for the transmission to complete in this mode.
+
+Rendering LED by LED needs a read-modify-write of six words for every LED and
+string. Where all six strings are rendered at once, a row of LEDs is bit sliced
+instead: the 24 bytes of the row are computed from the colors of all strings by
+a branchless transposition and written without masking. led_row() and maps that
+cover all strings over the same range of LEDs take this route, as does the ring
+encoder.
+Single LEDs on the other hand are written through the bit-band alias of the
+'bits' array by led_pixel(), with one store per bit and without masking. Maps of
+only a few LEDs take this route, too.
+
+The configured maps are compiled by led_compile() in advance, selecting a loop
+that is specialised to the kind of map: static fills, streams of consecutive
+triplets, sparse pixels and generic gathering from independent channels.
+Consecutive maps that feed several strings from the same source are fused, so
+the colors are computed and transposed only once for all of these strings.
+As rendering takes place on top of the previous frame, only LEDs whose input
+has changed in the meantime are re-encoded, according to the blocks of the input
+buffer marked as dirty. Any other change to the LEDs, the maps or the color
+tables renders the next frame completely.
+The maps read from the half of the input buffer that is not being written if
+they fit into it, see buffer.c.
+Maps that read consecutive triplets in the order they are received can be
+streamed instead: a decoder captures the planes at the start of a frame and
+passes every byte to led_stream(), which transposes the LEDs as soon as their
+triplets are complete. Such frames are not limited by the input buffer, and
+the maps need not wait for the end of the frame.
+The planes are not copied when a streamed frame is captured from the interrupt.
+If only the streamed LEDs lag behind, the frame renders them again anyway, and
+any of them it falls short of are restored at its end. Otherwise the main loop
+has to bring the back plane up to date by led_sync() before the frame can be
+streamed.
+
+Universes are only as long as the LEDs that have actually been written since the
+last led_clear(), which shortens the transmission of short strings. The frame
+rate is limited by the duration of such a universe only.
+
+Colors are gamma corrected through a lookup table that is rebuilt whenever the
+gamma changes, and then scaled by the dimming factor of their color. A table per
+color would save the multiplies but take another 512 bytes of RAM.
+
 Timing for WS2812B:
 
                 Thigh       Tlow        Tbit
@@ -57,6 +118,9 @@ Timing for SK6812:
 Performance thus is about 3*8*1200ns = 30us per LED plus another 80us for the
 reset. 24 bytes of RAM are needed for every set of LEDs (3 colors with 8 bits
 each, 8 LEDs in parallel). 512 LEDs per string then add up to about 13k of RAM.
+Double buffering is thus available for up to MAXLEDS/2 LEDs per string.
+In ring mode the pool takes only 3 bytes per LED and string. The ring must be
+re-encoded within the transmission time of RING LEDs, which is about 270us.
 
 The used Timer 3 instance is clocked from the APB1 bus clock.
 The APB1 bus clock is limited to 36MHz so if the system clock is 72MHz the bus
@@ -80,9 +144,15 @@ Running at 72MHz gives a period of T = 13.888..ns.
 
 #include "leds.h"
 
+#ifndef LED_RING
 #if (MAXLEDS < 0) || (MAXLEDS > 512)
 #   error Invalid LED count
 #endif
+#else
+#if (MAXLEDS < 0) || (MAXLEDS * 3 * 8 > UINT16_MAX)
+#   error Invalid LED count
+#endif
+#endif
 
 #if MAXBUFF < 1
 #   error Invalid buffer size
@@ -94,6 +164,9 @@ Running at 72MHz gives a period of T = 13.888..ns.
 #define T_BIT                 1400
 #define T_RESET             100000
 
+/* Maps of less LEDs are rendered pixel by pixel */
+#define SPARSE              8
+
 /* Enable startup delay in milliseconds */
 #define STARTUP             100
 
@@ -107,12 +180,70 @@ static const uint8_t ones =
 
 #define MAXBITS             ((MAXLEDS) * 3 * 8)
 static uint16_t nbits = MAXBITS;
+static uint16_t count = MAXLEDS;
+static uint16_t rate;
+
+/* Frame rate requested and the ceiling it has been limited by */
+static uint16_t requested;
+static uint16_t ceiled;
+static uint8_t sred, sgreen, sblue;
+/* Gamma in tenths, none until the table is built by led_gamma() */
+static uint8_t gamma;
+static uint16_t limit = MAXLEDS;
 
+#ifndef LED_RING
 /* Alignment required for uint32_t aliasing */
 static uint8_t bits[MAXBITS] __ALIGNED(4);
-static uint8_t sred, sgreen, sblue;
+
+/* Planes.
+Both point to the very same plane if double buffering is not possible. The
+second plane starts at half of the array and is thus aligned, too. */
+static uint8_t *front = bits;
+static uint8_t *back = bits;
+
+#else
+/* LEDs per half of the ring */
+#define RING                8
+
+static uint8_t ring[2 * RING * 3 * 8] __ALIGNED(4);
+static uint8_t pool[MAXPOOL * 3];
+static uint8_t *column[6];
+static uint16_t row;
+#endif
+
+/* Gamma lookup table and dimming factors. The factors are one more than the
+dimming levels unless zero, which compensates for the right shift by 8 bits
+that is used instead of a division by 255. */
+static uint8_t lgamma[256];
+static uint16_t fred, fgreen, fblue;
 
 volatile bool capture;
+static volatile bool defer;
+static volatile uint16_t missed;
+
+/* Number of LEDs that have been written since the last led_clear(), of all the
+configured maps and of the last universe */
+static uint16_t reach;
+static uint16_t mreach;
+static uint16_t sent;
+
+/* First LED of all the configured maps */
+static uint16_t mbase;
+
+/* Set if the maps must be rendered completely, regardless of the changes in the
+input buffer */
+static bool stale = true;
+
+#ifndef LED_RING
+/* Range of LEDs rendered into the back plane and range of LEDs in which the back
+plane lags behind the front plane, along with whether only streamed maps have
+been rendered into them */
+static uint16_t drawn[2] = { UINT16_MAX, 0 };
+static uint16_t lag[2] = { UINT16_MAX, 0 };
+static bool drawnstream = true;
+static bool lagstream = true;
+static bool skipped;
+#endif
 
 static uint32_t trr(uint32_t nsecs)
 {
@@ -168,18 +299,122 @@ void TIM4_IRQHandler(void)
             NVIC_DisableIRQ(TIM4_IRQn);
         }
     }
+    else if (!capture) {
+        /* No frame has been rendered since the last tick */
+        missed++;
+    }
 
     led_universe();
     TIM4->SR = ~TIM_SR_UIF;
 }
 
+static inline uint64_t transpose8(uint64_t x)
+{
+    /* Transposition of an 8x8 bit matrix.
+    Bit c of byte r is swapped with bit r of byte c by exchanging the 1x1, 2x2
+    and 4x4 blocks on either side of the diagonal. */
+    uint64_t t;
+    t = (x ^ (x >>  7)) & UINT64_C(0x00AA00AA00AA00AA);
+    x ^= t ^ (t <<  7);
+    t = (x ^ (x >> 14)) & UINT64_C(0x0000CCCC0000CCCC);
+    x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & UINT64_C(0x00000000F0F0F0F0);
+    x ^= t ^ (t << 28);
+    return x;
+}
+
+static void slice(uint8_t *restrict dst, const uint32_t *restrict triplet)
+{
+    /* Bit slicing of a complete row of LEDs.
+    For every color the bytes of all eight ports form an 8x8 bit matrix with
+    port p in byte p. After transposition every byte holds one bit of all the
+    ports, in reverse order though as the most significant bit is sent first,
+    which is undone by the byte reversal of each half.
+    The unused ports 0 and 1 are kept high like after led_clear(). dst must be
+    aligned to 4 bytes. */
+    uint32_t *alias = (uint32_t *) dst;
+    for (int8_t shift = 16; shift >= 0; shift -= 8) {
+        const uint32_t lo =
+            UINT32_C(0x0000FFFF) |
+            ((triplet[0] >> shift) & 0xFF) << 16 |
+            ((triplet[1] >> shift) & 0xFF) << 24;
+        const uint32_t hi =
+            ((triplet[2] >> shift) & 0xFF) <<  0 |
+            ((triplet[3] >> shift) & 0xFF) <<  8 |
+            ((triplet[4] >> shift) & 0xFF) << 16 |
+            ((triplet[5] >> shift) & 0xFF) << 24;
+
+        const uint64_t x = transpose8((uint64_t) hi << 32 | lo);
+        *alias++ = __REV(x >> 32);
+        *alias++ = __REV(x);
+    }
+}
+
+#ifdef LED_RING
+static void encode(uint8_t *restrict dst, uint16_t n)
+{
+    /* Encode the next n LEDs of all strings into the ring.
+    Strings that do not fit into the pool are kept low. */
+    while (n--) {
+        if (row >= limit)
+            break;
+
+        uint32_t triplet[6];
+        for (uint8_t string = 0; string < 6; string++) {
+            if (column[string]) {
+                const uint8_t *p = &column[string][row * 3];
+                triplet[string] =
+                    ((uint32_t) p[0] << 16) |
+                    ((uint32_t) p[1] <<  8) |
+                    ((uint32_t) p[2] <<  0);
+            }
+            else {
+                triplet[string] = 0xFFFFFF;
+            }
+        }
+
+        slice(dst, triplet);
+        dst += 3 * 8;
+        row++;
+    }
+}
+
+void DMA1_Channel2_IRQHandler(void) __USED;
+void DMA1_Channel2_IRQHandler(void)
+{
+    const uint32_t isr = DMA1->ISR;
+    DMA1->IFCR = DMA_IFCR_CHTIF2 | DMA_IFCR_CTCIF2;
+
+    /* Re-encode the half that has just been clocked out */
+    if (isr & DMA_ISR_HTIF2)
+        encode(&ring[0], RING);
+    if (isr & DMA_ISR_TCIF2)
+        encode(&ring[RING * 3 * 8], RING);
+}
+#endif
+
+void TIM3_IRQHandler(void) __USED;
+void TIM3_IRQHandler(void)
+{
+    /* End of reset duration */
+    TIM3->DIER &= ~TIM_DIER_UIE;
+    TIM3->SR = ~TIM_SR_UIF;
+
+    if (defer)
+        led_universe();
+}
+
 void DMA1_Channel6_IRQHandler(void) __USED;
 void DMA1_Channel6_IRQHandler(void)
 {
-    /* Preset timer for reset duration */
+    /* Preset timer for reset duration.
+    The update flag has been set by every single bit, so clear it before
+    enabling the interrupt for the end of the reset. */
     TIM3->CR1 &= ~TIM_CR1_CEN;
     TIM3->ARR = trr(T_RESET);
     TIM3->CNT = 0;
+    TIM3->SR = ~TIM_SR_UIF;
+    TIM3->DIER |= TIM_DIER_UIE;
     TIM3->CR1 |= TIM_CR1_OPM | TIM_CR1_CEN;
 
     /* Disable DMA and interrupt */
@@ -189,11 +424,39 @@ void DMA1_Channel6_IRQHandler(void)
 }
 
 
+static void flip(void)
+{
+#ifndef LED_RING
+    /* Swap planes if a new frame has been rendered into the back plane.
+    DMA1 channel 2 must be disabled. */
+    if (capture && front != back) {
+        uint8_t *p = front;
+        front = back;
+        back = p;
+
+        DMA1_Channel2->CMAR = (uint32_t) front;
+
+        lag[0] = drawn[0];
+        lag[1] = drawn[1];
+        lagstream = drawnstream;
+        drawn[0] = UINT16_MAX;
+        drawn[1] = 0;
+        drawnstream = true;
+    }
+#else
+    /* Encode first LEDs into the ring */
+    row = 0;
+    encode(ring, 2 * RING);
+#endif
+}
+
 void led_universe(void)
 {
     if (!NVIC_GetEnableIRQ(DMA1_Channel6_IRQn)) {
         /* Prevent parasitical currents when 5V power is disabled */
+        flip();
         capture = false;
+        defer = false;
         return;
     }
 
@@ -214,18 +477,38 @@ void led_universe(void)
     /* Reset bits */
     GPIOB->BRR = ones;
 
+    /* Transfer length.
+    Only the LEDs that have actually been written are sent. LEDs that are still
+    lit from an earlier universe are sent once more after they have been
+    cleared. */
+    uint16_t n = (reach > sent) ? reach : sent;
+    if (n > count)
+        n = count;
+    if (n < 1)
+        n = 1;
+
+    sent = reach;
+    nbits = n * 3 * 8;
+
     /* Restart.
-    CMAR/CPAR keep their values, so no need to reset. */
+    CMAR/CPAR keep their values unless the planes are swapped. */
+    flip();
     DMA1->IFCR = DMA_IFCR_CGIF6;
     DMA1_Channel6->CNDTR = nbits;
     DMA1_Channel3->CNDTR = nbits;
+#ifndef LED_RING
     DMA1_Channel2->CNDTR = nbits;
+#else
+    DMA1->IFCR = DMA_IFCR_CGIF2;
+    DMA1_Channel2->CNDTR = sizeof(ring)/sizeof(*ring);
+#endif
     DMA1_Channel6->CCR |= DMA_CCR6_EN | DMA_CCR6_TCIE;
     DMA1_Channel3->CCR |= DMA_CCR3_EN;
     DMA1_Channel2->CCR |= DMA_CCR2_EN;
     __DSB();
 
     capture = false;
+    defer = false;
     TIM3->CR1 |= TIM_CR1_CEN;
     NVIC_EnableIRQ(DMA1_Channel6_IRQn);
 }
@@ -235,26 +518,114 @@ bool led_busy(void)
     return TIM3->CR1 & TIM_CR1_CEN;
 }
 
-bool led_capture(void)
+static inline void extend(uint16_t begin, uint16_t end)
+{
+    /* Extend the range of LEDs rendered into the back plane */
+#ifndef LED_RING
+    if (begin < drawn[0])
+        drawn[0] = begin;
+    if (end > drawn[1])
+        drawn[1] = end;
+#else
+    (void) begin;
+    (void) end;
+#endif
+}
+
+static inline void draw(uint16_t begin, uint16_t end)
+{
+    /* Render anything but streamed maps */
+    extend(begin, end);
+#ifndef LED_RING
+    drawnstream = false;
+#endif
+}
+
+#ifndef LED_RING
+static void sync(void)
+{
+    /* Copy the LEDs in which the back plane lags behind */
+    const uint16_t end = (lag[1] < limit) ? lag[1] : limit;
+    if (lag[0] < end)
+        memcpy(&back[lag[0] * 3 * 8], &front[lag[0] * 3 * 8], (end - lag[0]) * 3 * 8);
+
+    lag[0] = UINT16_MAX;
+    lag[1] = 0;
+}
+#endif
+
+static bool seize(void)
 {
     /* Start-up delay */
     if (TIM4->CR1 & TIM_CR1_OPM)
         return false;
 
-    if (capture)
+    /* Frames may be captured by the main loop as well as by a decoder that
+    streams from its interrupt */
+    __disable_irq();
+    if (capture) {
+        __enable_irq();
         return false;
+    }
 
     /* Inhibit frame generation */
     NVIC_DisableIRQ(TIM4_IRQn);
-
+    capture = true;
+    __enable_irq();
+
+#ifndef LED_RING
+    if (front == back) {
+        /* Wait for DMA to complete */
+        if (DMA1_Channel6->CCR & DMA_CCR6_EN) {
+            capture = false;
+            return false;
+        }
+    }
+#else
     /* Wait for DMA to complete */
-    if (DMA1_Channel6->CCR & DMA_CCR6_EN)
+    if (DMA1_Channel6->CCR & DMA_CCR6_EN) {
+        capture = false;
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+bool led_capture(void)
+{
+    if (!seize())
         return false;
 
-    capture = true;
+#ifndef LED_RING
+    /* Render on top of the frame that is being clocked out */
+    if (front != back)
+        sync();
+#endif
     return true;
 }
 
+void led_sync(void)
+{
+    /* Bring the back plane up to date ahead of the next capture, so a decoder
+    that streams from its interrupt need not copy it */
+#ifndef LED_RING
+    __disable_irq();
+    if (capture || front == back || lag[0] >= lag[1] || lagstream) {
+        __enable_irq();
+        return;
+    }
+
+    NVIC_DisableIRQ(TIM4_IRQn);
+    capture = true;
+    __enable_irq();
+
+    sync();
+    capture = false;
+    NVIC_EnableIRQ(TIM4_IRQn);
+#endif
+}
+
 void led_release(void)
 {
     /* Release frame rate generator */
@@ -262,37 +633,77 @@ void led_release(void)
 
     if (capture) {
         /* Immediately generate asynchronous frame */
-        if ( !(TIM4->CR1 & TIM_CR1_CEN) )
-            led_universe();
+        if ( !(TIM4->CR1 & TIM_CR1_CEN) ) {
+            NVIC_DisableIRQ(TIM3_IRQn);
+            if (led_busy()) {
+                /* Defer until the reset of the current universe has elapsed */
+                defer = true;
+                NVIC_EnableIRQ(TIM3_IRQn);
+            }
+            else {
+                NVIC_EnableIRQ(TIM3_IRQn);
+                led_universe();
+            }
+        }
     }
 }
 
-void led_framerate(uint16_t fps)
+static uint32_t tick(void)
+{
+    /* Frame rate generator clock in Hertz */
+    return SystemCoreClock / (TIM4->PSC + 1);
+}
+
+static uint16_t ceiling(void)
+{
+    /* Highest frame rate that the duration of a universe permits */
+    uint16_t n = (mreach > reach) ? mreach : reach;
+    if (n == 0 || n > count)
+        n = count;
+
+    const uint32_t nsecs = (uint32_t) n * 3 * 8 * T_BIT + T_RESET;
+    const uint32_t fps = UINT32_C(1000000000) / nsecs;
+    return (fps < MAXFPS) ? fps : MAXFPS;
+}
+
+uint16_t led_framerate(uint16_t fps)
 {
     /* Stop and inhibit frame rate generator */
     TIM4->CR1 &= ~TIM_CR1_CEN;
     NVIC_DisableIRQ(TIM4_IRQn);
+    requested = fps;
 
     /* Frame generator.
     TIM4 is a 16 bit wide counter. Its clock must be divided by the prescaler to
     less than 65565Hz to be able to achieve the lowest desired framerate of
-    1fps. */
+    1fps. Any higher framerate is generated from a clock of 100kHz for a finer
+    resolution. */
     if (fps == 0) {
         /* Manual triggering via led_universe() */
         TIM4->ARR = 0;
+        rate = 0;
     }
     else {
-        if (fps > 50)
-            fps = 50;
+        const uint16_t max = ceiling();
+        ceiled = max;
+        if (fps > max)
+            fps = max;
 
-        /* Timer has auto-preload reload enabled */
+        /* Remaining start-up delay in ticks of the new clock */
+        const uint32_t hz = (fps < 2) ? UINT32_C(10000) : UINT32_C(100000);
         const uint16_t arr = TIM4->ARR;
-        TIM4->ARR = UINT32_C(10000) / fps;
+        const uint16_t remaining = (uint16_t) (arr - TIM4->CNT) * hz / tick();
+
+        /* Load prescaler and reload value by an update event */
+        TIM4->PSC = SystemCoreClock / hz - 1;
+        TIM4->ARR = hz / fps - 1;
+        TIM4->EGR = TIM_EGR_UG;
+        TIM4->SR = ~TIM_SR_UIF;
+        rate = hz / (TIM4->ARR + 1);
 
         if (NVIC_GetEnableIRQ(DMA1_Channel6_IRQn)) {
             if (TIM4->CR1 & TIM_CR1_OPM) {
                 /* Continue with start-up delay */
-                const uint16_t remaining = arr - TIM4->CNT;
                 TIM4->CNT = TIM4->ARR - remaining;
 
                 /* Re-start frame rate generator for first frame */
@@ -308,8 +719,32 @@ void led_framerate(uint16_t fps)
             /* Release frame rate generator */
             NVIC_EnableIRQ(TIM4_IRQn);
         }
-
     }
+
+    return rate;
+}
+
+static void rerate(void)
+{
+    /* Limit the requested frame rate anew once the duration of a universe has
+    changed */
+    if (requested && ceiling() != ceiled)
+        led_framerate(requested);
+}
+
+uint16_t led_rate(void)
+{
+    return rate;
+}
+
+uint16_t led_missed(void)
+{
+    /* Number of frame ticks without a new frame since the last call */
+    __disable_irq();
+    uint16_t n = missed;
+    missed = 0;
+    __enable_irq();
+    return n;
 }
 
 void led_enable(bool enable)
@@ -330,7 +765,7 @@ void led_enable(bool enable)
         led_clear();
 
         /* Generate first frame after start-up delay */
-        TIM4->CNT = TIM4->ARR - (STARTUP * 10);
+        TIM4->CNT = TIM4->ARR - STARTUP * (tick() / 1000);
 
         /* Start frame rate generator for first frame */
         TIM4->SR = ~TIM_SR_UIF;
@@ -361,15 +796,48 @@ void led_enable(bool enable)
 
 void led_length(uint16_t length)
 {
+    stale = true;
     if (length < 1)
         length = 1;
     else if (length > MAXLEDS)
         length = MAXLEDS;
 
-    nbits = length * 3 * 8;
+    count = length;
+
+#ifndef LED_RING
+    /* Double buffering if two planes fit into the array */
+    uint16_t l = (length <= MAXLEDS/2) ? MAXLEDS/2 : MAXLEDS;
+    if (l != limit) {
+        while (led_busy());
+        limit = l;
+
+        /* The first plane retains the current frame */
+        front = bits;
+        back = (limit < MAXLEDS) ? &bits[MAXBITS/2] : bits;
+        DMA1_Channel2->CMAR = (uint32_t) front;
+        drawn[0] = UINT16_MAX;
+        drawn[1] = 0;
+        lag[0] = 0;
+        lag[1] = limit;
+        lagstream = false;
+    }
+#else
+    /* Lay out strings in the pool */
+    while (led_busy());
+    limit = length;
+    for (uint8_t string = 0; string < 6; string++) {
+        if ((string + 1) * length <= MAXPOOL)
+            column[string] = &pool[string * length * 3];
+        else
+            column[string] = 0;
+    }
+#endif
+
+    rerate();
 }
 
 
+#ifndef LED_RING
 static void transpose(uint16_t offset, uint8_t string, uint32_t triplet)
 {
     /* Pointer aliasing and transposition.
@@ -382,7 +850,7 @@ static void transpose(uint16_t offset, uint8_t string, uint32_t triplet)
     consecutive bytes in the pattern at once. */
     uint8_t port = 2 + string;
     uint32_t mask = 0x01010101 << port;
-    uint32_t *alias = (uint32_t *) &bits[offset * 3 * 8];
+    uint32_t *alias = (uint32_t *) &back[offset * 3 * 8];
 
 #define TRANSPOSE(x, srcbit, dstbyte) \
     ( (((x) >> (srcbit)) & 1) << ((dstbyte) * 8) )
@@ -430,13 +898,85 @@ static void transpose(uint16_t offset, uint8_t string, uint32_t triplet)
         TRANSPOSE(triplet,  0, 3)) << port;
 }
 
+static void spread(uint16_t offset, uint8_t strings, uint32_t triplet)
+{
+    /* Transposition for several strings at once.
+    The pattern holds the bits in the least significant bit of every byte, so
+    multiplying it by the port mask replicates it to all the ports without any
+    carries. */
+    const uint32_t ports = (uint32_t) strings << 2;
+    const uint32_t mask = 0x01010101 * ports;
+    uint32_t *alias = (uint32_t *) &back[offset * 3 * 8];
+
+    for (int8_t bit = 23; bit >= 0; bit -= 4) {
+        const uint32_t pattern =
+            TRANSPOSE(triplet, bit - 0, 0) |
+            TRANSPOSE(triplet, bit - 1, 1) |
+            TRANSPOSE(triplet, bit - 2, 2) |
+            TRANSPOSE(triplet, bit - 3, 3);
+
+        *alias = (*alias & ~mask) | (pattern * ports);
+        alias++;
+    }
+}
+
+static void pixel(uint16_t offset, uint8_t string, uint32_t triplet)
+{
+    /* Bit-band access.
+    Every bit in SRAM is mirrored to a word in the bit-band alias region, so the
+    bit of a single port can be written with a single store and without masking.
+    The aliases of the bit in consecutive bytes are eight words apart. */
+    const uint32_t addr = (uint32_t) &back[offset * 3 * 8];
+    volatile uint32_t *alias = (volatile uint32_t *) (
+        SRAM_BB_BASE + (addr - SRAM_BASE) * 32 + (2 + string) * 4);
+
+    for (int8_t bit = 23; bit >= 0; bit--) {
+        *alias = (triplet >> bit) & 1;
+        alias += 8;
+    }
+}
+
+#else
+static void transpose(uint16_t offset, uint8_t string, uint32_t triplet)
+{
+    /* Store in pool, in transmission order */
+    uint8_t *p = column[string];
+    if (p) {
+        p += offset * 3;
+        *p++ = (triplet >> 16) & 0xFF;
+        *p++ = (triplet >>  8) & 0xFF;
+        *p++ = (triplet >>  0) & 0xFF;
+    }
+}
+
+/* Storing to the pool is cheap anyway */
+#define pixel transpose
+
+static void spread(uint16_t offset, uint8_t strings, uint32_t triplet)
+{
+    for (uint8_t string = 0; string < 6; string++) {
+        if (strings & (1 << string))
+            transpose(offset, string, triplet);
+    }
+}
+#endif
+
+static inline void store(uint16_t offset, const uint32_t *restrict triplet)
+{
+    /* Store the triplets of all six strings at once */
+#ifndef LED_RING
+    slice(&back[offset * 3 * 8], triplet);
+#else
+    for (uint8_t string = 0; string < 6; string++)
+        transpose(offset, string, triplet[string]);
+#endif
+}
+
 static inline uint32_t scale(uint8_t red, uint8_t green, uint8_t blue)
 {
-    /* (color > 0) is equal to 1 if color is nonzero. This compensates for the
-    right shift by 8 bits that is used instead of a division by 255. */
-    uint32_t r = ( ((uint16_t) red      + (red   > 0) )   * sred)   >> 8;
-    uint32_t g = ( ((uint16_t) green    + (green > 0) ) * sgreen)   >> 8;
-    uint32_t b = ( ((uint16_t) blue     + (blue  > 0) )  * sblue)   >> 8;
+    uint32_t r = (lgamma[red] * fred) >> 8;
+    uint32_t g = (lgamma[green] * fgreen) >> 8;
+    uint32_t b = (lgamma[blue] * fblue) >> 8;
 
     /* Bit arrangement.
                 23 .. 16    15 ..  8     7 ..  0
@@ -449,10 +989,14 @@ static inline uint32_t scale(uint8_t red, uint8_t green, uint8_t blue)
 
 void led_cmy(uint16_t offset, uint8_t string, uint8_t cyan, uint8_t magenta, uint8_t yellow)
 {
+    stale = true;
     if (string > 5)
         string = 5;
-    if (offset >= MAXLEDS)
-        offset = MAXLEDS - 1;
+    if (offset >= limit)
+        return;
+    if (offset >= reach)
+        reach = offset + 1;
+    draw(offset, offset + 1);
 
     uint32_t triplet = scale(~cyan, ~magenta, ~yellow);
     transpose(offset, string, triplet);
@@ -461,117 +1005,811 @@ void led_cmy(uint16_t offset, uint8_t string, uint8_t cyan, uint8_t magenta, uin
 
 void led_rgb(uint16_t offset, uint8_t string, uint8_t red, uint8_t green, uint8_t blue)
 {
+    stale = true;
     if (string > 5)
         string = 5;
-    if (offset >= MAXLEDS)
-        offset = MAXLEDS - 1;
+    if (offset >= limit)
+        return;
+    if (offset >= reach)
+        reach = offset + 1;
+    draw(offset, offset + 1);
 
     uint32_t triplet = scale(red, green, blue);
     transpose(offset, string, triplet);
 }
 
+void led_pixel(uint16_t offset, uint8_t string, uint8_t red, uint8_t green, uint8_t blue)
+{
+    stale = true;
+    if (string > 5)
+        string = 5;
+    if (offset >= limit)
+        return;
+    if (offset >= reach)
+        reach = offset + 1;
+    draw(offset, offset + 1);
+
+    uint32_t triplet = scale(red, green, blue);
+    pixel(offset, string, triplet);
+}
+
+void led_row(uint16_t offset, uint8_t rgb[6][3])
+{
+    stale = true;
+    if (offset >= limit)
+        return;
+    if (offset >= reach)
+        reach = offset + 1;
+    draw(offset, offset + 1);
+
+    uint32_t triplet[6];
+    for (uint8_t string = 0; string < 6; string++)
+        triplet[string] = scale(rgb[string][0], rgb[string][1], rgb[string][2]);
+
+    store(offset, triplet);
+}
+
 void led_clear(void)
 {
-    memset(bits, 0xFF, MAXBITS);
+    stale = true;
+    reach = 0;
+#ifndef LED_RING
+    /* Do not interfere with the front plane whilst rendering */
+    if (capture) {
+        memset(back, 0xFF, limit * 3 * 8);
+        draw(0, limit);
+    }
+    else {
+        memset(bits, 0xFF, MAXBITS);
+        drawn[0] = lag[0] = UINT16_MAX;
+        drawn[1] = lag[1] = 0;
+    }
+#else
+    memset(pool, 0xFF, sizeof(pool)/sizeof(*pool));
+#endif
+}
+
+static uint8_t power(uint8_t level)
+{
+    /* Gamma correction in fixed point.
+    level^gamma is computed as 2^(gamma * log2(level)) with level normalized to
+    the range 0 .. 1 and both logarithm and exponential in Q16. The logarithm
+    is obtained bit by bit by repeated squaring, the fractional part of the
+    exponential by a polynomial approximation. */
+    if (level == 0)
+        return 0;
+
+    uint32_t x = ((uint32_t) level << 16) / 255;
+    int32_t y = 0;
+    while (x < (UINT32_C(1) << 16)) {
+        x <<= 1;
+        y -= INT32_C(1) << 16;
+    }
+
+    for (int32_t bit = INT32_C(1) << 15; bit; bit >>= 1) {
+        x = ((uint64_t) x * x) >> 16;
+        if (x >= (UINT32_C(2) << 16)) {
+            x >>= 1;
+            y += bit;
+        }
+    }
+
+    /* Gamma is given in tenths */
+    y = y * gamma / 10;
+
+    /* Split into integral and fractional part, rounding towards -infinity */
+    const int32_t n = -((-y + 0xFFFF) >> 16);
+    const uint32_t f = y - n * (INT32_C(1) << 16);
+    if (n <= -16)
+        return 0;
+
+    uint32_t p = 5184;
+    p = 14752 + ((p * f) >> 16);
+    p = 45600 + ((p * f) >> 16);
+    p = 65536 + ((p * f) >> 16);
+    p >>= -n;
+
+    return (p * 255 + 0x8000) >> 16;
+}
+
+static void tabulate(void)
+{
+    for (uint16_t i = 0; i < 256; i++)
+        lgamma[i] = (gamma == 10) ? i : power(i);
 }
 
 void led_dim(uint8_t red, uint8_t green, uint8_t blue)
 {
+    /* (level > 0) is equal to 1 if level is nonzero */
+    if (red != sred || green != sgreen || blue != sblue)
+        stale = true;
+
     sred = red;
     sgreen = green;
     sblue = blue;
+    fred = red + (red > 0);
+    fgreen = green + (green > 0);
+    fblue = blue + (blue > 0);
 }
 
-static inline void map2(struct led_map_t *restrict map, const uint8_t *restrict buf)
+void led_gamma(uint8_t tenths)
 {
-    uint8_t r = map->red.value;
-    const uint8_t *br, *er, *pr;
-    if (map->flags & MAP_STATIC_RED) {
-        br = &r;
-        er = 0;
+    if (tenths < 10)
+        tenths = 10;
+    else if (tenths > 30)
+        tenths = 30;
+
+    if (tenths != gamma) {
+        gamma = tenths;
+        tabulate();
+        stale = true;
+    }
+}
+
+struct channel {
+    const uint8_t *p;
+    const uint8_t *begin;
+    const uint8_t *end;
+    int8_t step;
+};
+
+static inline void channel(struct channel *restrict ch, const uint8_t *restrict buf, bool fixed, uint16_t begin, uint16_t end, int8_t step, const uint8_t *value)
+{
+    if (fixed) {
+        ch->begin = value;
+        ch->end = 0;
     }
     else {
-        br = &buf[map->red.begin];
-        er = &buf[map->red.end];
+        ch->begin = &buf[begin];
+        ch->end = &buf[end];
     }
 
-    uint8_t g = map->green.value;
-    const uint8_t *bg, *eg, *pg;
-    if (map->flags & MAP_STATIC_GREEN) {
-        bg = &g;
-        eg = 0;
+    ch->p = ch->begin;
+    ch->step = step;
+}
+
+static inline uint8_t fetch(struct channel *restrict ch)
+{
+    /* Fetch current value and advance, wrapping around at the end */
+    const uint8_t v = *ch->p;
+    if (ch->p == ch->end)
+        ch->p = ch->begin;
+    else
+        ch->p += ch->step;
+
+    return v;
+}
+
+static inline bool changed(const uint8_t *p)
+{
+    /* Input has changed since the last frame.
+    Static values do not live in the buffer and thus never change. */
+    const uintptr_t i = (uintptr_t) p - (uintptr_t) rbuf;
+    if (i >= MAXBUFF)
+        return false;
+
+    const uint16_t b = i / BUFBLOCK;
+    return rdirty[b / 32] & (UINT32_C(1) << (b % 32));
+}
+
+static inline void track(struct channel *restrict ch, const struct led_map_t *restrict map, const uint8_t *restrict buf)
+{
+    channel(&ch[0], buf, map->flags & MAP_STATIC_RED,
+        map->red.begin, map->red.end, map->red.step, &map->red.value);
+    channel(&ch[1], buf, map->flags & MAP_STATIC_GREEN,
+        map->green.begin, map->green.end, map->green.step, &map->green.value);
+    channel(&ch[2], buf, map->flags & MAP_STATIC_BLUE,
+        map->blue.begin, map->blue.end, map->blue.step, &map->blue.value);
+}
+
+static inline uint32_t pick(struct channel *restrict ch, uint8_t flags)
+{
+    const uint8_t r = fetch(&ch[0]);
+    const uint8_t g = fetch(&ch[1]);
+    const uint8_t b = fetch(&ch[2]);
+    if (flags & MAP_CMY)
+        return scale(~r, ~g, ~b);
+    else
+        return scale(r, g, b);
+}
+
+static uint16_t span(const struct led_map_t *restrict map)
+{
+    /* Number of LEDs covered by a map at most.
+    The map ends at its last LED if that is hit by the step, otherwise at the
+    end of the string. */
+    const int32_t d = (int32_t) map->end - map->begin;
+    if (map->step == 0)
+        return 1;
+    if (d % map->step == 0 && d / map->step >= 0)
+        return d / map->step + 1;
+    if (map->step > 0)
+        return (MAXLEDS - map->begin + map->step - 1) / map->step;
+    else
+        return map->begin / -map->step + 1;
+}
+
+static bool linear(uint16_t begin, uint16_t end, int8_t step, uint16_t n)
+{
+    /* Source channel does not wrap around within n LEDs */
+    const int32_t d = (int32_t) end - begin;
+    if (step == 0)
+        return true;
+    if (d % step == 0 && d / step >= 0)
+        return n - 1 <= d / step;
+    return true;
+}
+
+static uint16_t extent(const struct led_map_t *restrict map)
+{
+    /* Number of LEDs up to the last one covered by a map */
+    uint16_t n = map->begin + 1;
+    if (map->step > 0)
+        n += (span(map) - 1) * map->step;
+
+    return (n < MAXLEDS) ? n : MAXLEDS;
+}
+
+static uint16_t base(const struct led_map_t *restrict map)
+{
+    /* First LED covered by a map */
+    if (map->step >= 0)
+        return map->begin;
+
+    const uint32_t d = (uint32_t) (span(map) - 1) * -map->step;
+    return (d < map->begin) ? map->begin - d : 0;
+}
+
+static uint16_t upto(uint16_t begin, uint16_t end, int8_t step, uint16_t n)
+{
+    /* Number of bytes up to the last one read by a channel within n LEDs */
+    if (!linear(begin, end, step, n))
+        return ((begin > end) ? begin : end) + 1;
+    if (step > 0)
+        return begin + (n - 1) * step + 1;
+    return begin + 1;
+}
+
+static uint16_t source(const struct led_map_t *restrict map)
+{
+    /* Number of bytes of the buffer up to the last one read by a map.
+    LEDs beyond MAXLEDS are never rendered and do not count. */
+    uint16_t n = span(map);
+    if (map->step > 0) {
+        const uint16_t k = (MAXLEDS - map->begin + map->step - 1) / map->step;
+        if (k < n)
+            n = k;
     }
-    else {
-        bg = &buf[map->green.begin];
-        eg = &buf[map->green.end];
+
+    uint16_t bytes = 0, b;
+    if (!(map->flags & MAP_STATIC_RED)) {
+        b = upto(map->red.begin, map->red.end, map->red.step, n);
+        if (b > bytes)
+            bytes = b;
+    }
+    if (!(map->flags & MAP_STATIC_GREEN)) {
+        b = upto(map->green.begin, map->green.end, map->green.step, n);
+        if (b > bytes)
+            bytes = b;
+    }
+    if (!(map->flags & MAP_STATIC_BLUE)) {
+        b = upto(map->blue.begin, map->blue.end, map->blue.step, n);
+        if (b > bytes)
+            bytes = b;
     }
 
-    uint8_t b = map->blue.value;
-    const uint8_t *bb, *eb, *pb;
-    if (map->flags & MAP_STATIC_BLUE) {
-        bb = &b;
-        eb = 0;
+    return bytes;
+}
+
+static bool consecutive(const struct led_map_t *restrict map, uint16_t n)
+{
+    /* Consecutive red, green and blue in the buffer */
+    return
+        map->green.begin == map->red.begin + 1 &&
+        map->blue.begin == map->red.begin + 2 &&
+        map->green.step == map->red.step &&
+        map->blue.step == map->red.step &&
+        linear(map->red.begin, map->red.end, map->red.step, n) &&
+        linear(map->green.begin, map->green.end, map->green.step, n) &&
+        linear(map->blue.begin, map->blue.end, map->blue.step, n);
+}
+
+enum run_t
+{
+    run_gather = 0,
+    run_sparse,
+    run_fill,
+    run_stream,
+    run_row,
+};
+
+static enum run_t classify(const struct led_map_t *restrict map)
+{
+    const uint16_t n = span(map);
+    if (n <= SPARSE)
+        return run_sparse;
+
+    const uint8_t fixed = MAP_STATIC_RED | MAP_STATIC_GREEN | MAP_STATIC_BLUE;
+    if ((map->flags & fixed) == fixed)
+        return run_fill;
+
+    if ((map->flags & fixed) == 0 && consecutive(map, n))
+        return run_stream;
+
+    return run_gather;
+}
+
+static void gather(const struct led_map_t *restrict map, uint8_t strings, const uint8_t *restrict buf, bool sparse)
+{
+    /* Generic map with independent source channels */
+    struct channel ch[3];
+    track(ch, map, buf);
+
+    uint16_t n = span(map);
+    for (uint16_t i = map->begin; n-- && i < limit; i += map->step) {
+        const bool update =
+            stale ||
+            changed(ch[0].p) ||
+            changed(ch[1].p) ||
+            changed(ch[2].p);
+
+        const uint32_t triplet = pick(ch, map->flags);
+        if (!update)
+            continue;
+
+        if (sparse) {
+            for (uint8_t string = 0; string < 6; string++) {
+                if (strings & (1 << string))
+                    pixel(i, string, triplet);
+            }
+        }
+        else {
+            spread(i, strings, triplet);
+        }
     }
-    else {
-        bb = &buf[map->blue.begin];
-        eb = &buf[map->blue.end];
+}
+
+static void fill(const struct led_map_t *restrict map, uint8_t strings)
+{
+    /* Static colors only change with the configuration */
+    if (!stale)
+        return;
+
+    uint32_t triplet;
+    if (map->flags & MAP_CMY)
+        triplet = scale(~map->red.value, ~map->green.value, ~map->blue.value);
+    else
+        triplet = scale(map->red.value, map->green.value, map->blue.value);
+
+    uint16_t n = span(map);
+    uint16_t i = map->begin;
+    if (i >= limit)
+        return;
+
+#ifndef LED_RING
+    /* Transpose once and copy the bits of the ports to the other LEDs */
+    spread(i, strings, triplet);
+    const uint32_t mask = 0x01010101 * ((uint32_t) strings << 2);
+    const uint32_t *pattern = (const uint32_t *) &back[i * 3 * 8];
+
+    for (n--, i += map->step; n-- && i < limit; i += map->step) {
+        uint32_t *alias = (uint32_t *) &back[i * 3 * 8];
+        for (uint8_t k = 0; k < 6; k++)
+            alias[k] = (alias[k] & ~mask) | (pattern[k] & mask);
+    }
+#else
+    for (; n-- && i < limit; i += map->step)
+        spread(i, strings, triplet);
+#endif
+}
+
+static inline void stream2(const struct led_map_t *restrict map, uint8_t strings, const uint8_t *restrict buf, bool cmy)
+{
+    const uint8_t *p = &buf[map->red.begin];
+    const int8_t step = map->red.step;
+
+    uint16_t n = span(map);
+    for (uint16_t i = map->begin; n-- && i < limit; i += map->step) {
+        if (stale || changed(&p[0]) || changed(&p[2])) {
+            if (cmy)
+                spread(i, strings, scale(~p[0], ~p[1], ~p[2]));
+            else
+                spread(i, strings, scale(p[0], p[1], p[2]));
+        }
+
+        p += step;
+    }
+}
+
+static void stream(const struct led_map_t *restrict map, uint8_t strings, const uint8_t *restrict buf)
+{
+    /* Consecutive triplets without wrap-around */
+    if (map->flags & MAP_CMY)
+        stream2(map, strings, buf, true);
+    else
+        stream2(map, strings, buf, false);
+}
+
+static bool shared(const struct led_map_t *restrict a, const struct led_map_t *restrict b)
+{
+    /* Same LEDs fed from the same source */
+    if (a->begin != b->begin ||
+        a->end != b->end ||
+        a->step != b->step ||
+        a->flags != b->flags)
+        return false;
+
+#define SHARED(c, fixed) \
+    ( (a->flags & (fixed)) ? \
+        (a->c.value == b->c.value) : \
+        (a->c.begin == b->c.begin && a->c.end == b->c.end && a->c.step == b->c.step) )
+
+    return
+        SHARED(red, MAP_STATIC_RED) &&
+        SHARED(green, MAP_STATIC_GREEN) &&
+        SHARED(blue, MAP_STATIC_BLUE);
+}
+
+static uint8_t fuse(const struct led_map_t *restrict map, size_t n, uint8_t *restrict strings)
+{
+    /* Number of consecutive maps on distinct strings that share their source */
+    uint8_t k;
+    *strings = 1 << map[0].string;
+    for (k = 1; k < n; k++) {
+        if (map[k].string > 5 || (*strings & (1 << map[k].string)))
+            break;
+        if (!shared(&map[0], &map[k]))
+            break;
+
+        *strings |= 1 << map[k].string;
+    }
+
+    return k;
+}
+
+static bool parallel(const struct led_map_t *restrict map, size_t n)
+{
+    /* Six maps that cover all strings over the very same range of LEDs can be
+    rendered row by row */
+    if (n < 6)
+        return false;
+
+    uint8_t strings = 0;
+    for (uint8_t k = 0; k < 6; k++) {
+        if (map[k].string > 5)
+            return false;
+        if (map[k].begin != map[0].begin ||
+            map[k].end != map[0].end ||
+            map[k].step != map[0].step)
+            return false;
+
+        strings |= 1 << map[k].string;
+    }
+
+    return strings == 0x3F;
+}
+
+static void map6(const struct led_map_t *restrict map, const uint8_t *restrict buf)
+{
+    struct channel ch[6][3];
+    uint8_t flags[6];
+    for (uint8_t k = 0; k < 6; k++) {
+        track(ch[map[k].string], &map[k], buf);
+        flags[map[k].string] = map[k].flags;
+    }
+
+    uint16_t n = span(map);
+    for (uint16_t i = map->begin; n-- && i < limit; i += map->step) {
+        bool update = stale;
+        uint32_t triplet[6];
+        for (uint8_t string = 0; string < 6; string++) {
+            struct channel *c = ch[string];
+            update = update || changed(c[0].p) || changed(c[1].p) || changed(c[2].p);
+            triplet[string] = pick(c, flags[string]);
+        }
+
+        if (update)
+            store(i, triplet);
+    }
+}
+
+static void render(const struct led_map_t *restrict map, enum run_t run, uint8_t strings, const uint8_t *restrict buf)
+{
+    switch (run) {
+    case run_gather:    gather(map, strings, buf, false);   break;
+    case run_sparse:    gather(map, strings, buf, true);    break;
+    case run_fill:      fill(map, strings);                 break;
+    case run_stream:    stream(map, strings, buf);          break;
+    case run_row:       map6(map, buf);                     break;
     }
+}
 
-    pr = br;
-    pg = bg;
-    pb = bb;
+/* Compiled maps */
+static struct {
+    uint8_t map;
+    uint8_t run;
+    uint8_t strings;
+    uint16_t bytes;
+} runs[sizeof(config.leds.map)/sizeof(*config.leds.map)];
+static uint8_t nruns;
+
+/* Streamed maps, with the number of LEDs of the frame in the front plane */
+static struct {
+    uint8_t map;
+    uint16_t next;
+    uint16_t led;
+    uint16_t n;
+    uint16_t shown;
+} cursor[sizeof(config.leds.map)/sizeof(*config.leds.map)];
+static uint8_t ncursors;
+static uint16_t due;
+static bool streamable;
+static bool streamed;
+
+void led_map(struct led_map_t *restrict map)
+{
+    /* The configured maps must overwrite this one completely */
+    stale = true;
 
     /* Sanity */
     if (map->string > 5)
         map->string = 5;
-    if (map->begin >= MAXLEDS)
-        map->begin = MAXLEDS - 1;
 
-    for (uint16_t i = map->begin; i < MAXLEDS; i += map->step) {
-        uint32_t triplet;
-        if (map->flags & MAP_CMY)
-            triplet = scale(~*pr, ~*pg, ~*pb);
-        else
-            triplet = scale(*pr, *pg, *pb);
+    const uint16_t n = extent(map);
+    if (n > reach)
+        reach = n;
+    draw(base(map), n);
+
+    /* Maps that are not compiled may read beyond the half of a split buffer,
+    but not beyond the buffer itself */
+    const uint16_t bytes = source(map);
+    if (bytes > MAXBUFF)
+        return;
 
-        transpose(i, map->string, triplet);
+    const uint8_t *buf = (bytes <= nbuf) ? rbuf : buffer;
+    render(map, classify(map), 1 << map->string, buf);
+}
 
-        if (i == map->end)
+void led_compile(void)
+{
+    /* Select the specialised loop for every map in advance.
+    Maps are applied in order, so only consecutive maps are combined. Maps that
+    share their source are computed once for all of their strings, other maps
+    that cover all strings over the very same LEDs are rendered row by row. */
+    struct led_map_t *map = config.leds.map;
+    const size_t n = sizeof(config.leds.map)/sizeof(*config.leds.map);
+
+    /* Split the input buffer if the maps read only its lower half */
+    uint16_t bytes = 0;
+    for (size_t i = 0; i < n && map[i].string != 0xFF; i++) {
+        const uint16_t b = source(&map[i]);
+        if (b > bytes)
+            bytes = b;
+    }
+    buf_split(bytes <= MAXBUFF / 2);
+
+    stale = true;
+    nruns = 0;
+    mbase = UINT16_MAX;
+    mreach = 0;
+    ncursors = 0;
+    streamable = true;
+    for (size_t i = 0; i < n; ) {
+        if (map[i].string == 0xFF)
             break;
 
-        if (pr == er)
-            pr = br;
-        else
-            pr += map->red.step;
+        const uint16_t e = extent(&map[i]);
+        if (e > mreach)
+            mreach = e;
+        const uint16_t b = base(&map[i]);
+        if (b < mbase)
+            mbase = b;
+
+        /* Sanity */
+        if (map[i].string > 5)
+            map[i].string = 5;
+
+        runs[nruns].map = i;
+
+        uint8_t strings;
+        const uint8_t k = fuse(&map[i], n - i, &strings);
+        if (k == 1 && parallel(&map[i], n - i)) {
+            runs[nruns].run = run_row;
+            runs[nruns].strings = 0x3F;
+            runs[nruns].bytes = 0;
+            for (uint8_t j = 0; j < 6; j++) {
+                const uint16_t b = source(&map[i + j]);
+                if (b > runs[nruns].bytes)
+                    runs[nruns].bytes = b;
+            }
+            i += 6;
+        }
+        else {
+            runs[nruns].run = classify(&map[i]);
+            runs[nruns].strings = strings;
+            runs[nruns].bytes = source(&map[i]);
+            i += k;
+        }
 
-        if (pg == eg)
-            pg = bg;
-        else
-            pg += map->green.step;
+        nruns++;
+    }
 
-        if (pb == eb)
-            pb = bb;
-        else
-            pb += map->blue.step;
+    /* Maps can be streamed if they read the triplets in the order they are
+    received, apart from static colors */
+    const uint8_t fixed = MAP_STATIC_RED | MAP_STATIC_GREEN | MAP_STATIC_BLUE;
+    for (size_t i = 0; i < n && map[i].string != 0xFF; i++) {
+        if ((map[i].flags & fixed) == fixed)
+            continue;
+
+        if ((map[i].flags & fixed) != 0 ||
+            map[i].red.step <= 0 ||
+            !consecutive(&map[i], span(&map[i])))
+            streamable = false;
+
+        cursor[ncursors++].map = i;
     }
+
+    if (!ncursors)
+        streamable = false;
+
+#ifndef LED_RING
+    /* The streamed LEDs of the front plane are unknown */
+    lagstream = false;
+#endif
+
+    rerate();
 }
 
-void led_map(struct led_map_t *restrict map)
+void led_maps(void)
 {
-    map2(map, buffer);
+    if (mreach > reach)
+        reach = mreach;
+    draw(mbase, mreach);
+    rerate();
+
+    /* Streamed frames bypass the tracking of changes */
+    if (streamed) {
+        streamed = false;
+        stale = true;
+    }
+
+    for (uint8_t i = 0; i < nruns; i++) {
+        /* Maps beyond the input buffer can only be streamed */
+        if (runs[i].bytes > nbuf)
+            continue;
+
+        const struct led_map_t *map = &config.leds.map[runs[i].map];
+        render(map, runs[i].run, runs[i].strings, rbuf);
+    }
+
+    /* Only changes need to be rendered from now on */
+    stale = false;
+    buf_clean();
 }
 
-void led_maps(void)
+static void advance(void)
 {
-    for (size_t i = 0; i < sizeof(config.leds.map)/sizeof(*config.leds.map); i++) {
-        if (config.leds.map[i].string == 0xFF)
-            break;
-        led_map(&config.leds.map[i]);
+    /* Index of the byte that completes the next triplet */
+    due = UINT16_MAX;
+    for (uint8_t i = 0; i < ncursors; i++) {
+        if (cursor[i].n && cursor[i].next < due)
+            due = cursor[i].next;
     }
 }
 
+bool led_stream_begin(void)
+{
+    /* Capture the planes for a frame that is rendered as it is received */
+    if (!streamable)
+        return false;
+    if (!seize())
+        return false;
+
+#ifndef LED_RING
+    /* Copying the planes takes too long in interrupt context. The frame may
+    only skip this if the back plane lags behind in the streamed LEDs alone,
+    as these are all rendered again. Otherwise the main loop has to bring the
+    back plane up to date first, see led_sync(). */
+    skipped = (front != back) && lag[0] < lag[1];
+    if (skipped && !lagstream) {
+        capture = false;
+        NVIC_EnableIRQ(TIM4_IRQn);
+        return false;
+    }
+
+    if (stale)
+        drawnstream = false;
+#endif
+
+    if (mreach > reach)
+        reach = mreach;
+    extend(mbase, mreach);
+
+    /* Static colors */
+    const uint8_t fixed = MAP_STATIC_RED | MAP_STATIC_GREEN | MAP_STATIC_BLUE;
+    for (uint8_t i = 0; i < nruns; i++) {
+        const struct led_map_t *map = &config.leds.map[runs[i].map];
+        if ((map->flags & fixed) == fixed)
+            render(map, runs[i].run, runs[i].strings, rbuf);
+    }
+
+    stale = false;
+    streamed = true;
+
+    for (uint8_t i = 0; i < ncursors; i++) {
+        const struct led_map_t *map = &config.leds.map[cursor[i].map];
+        cursor[i].next = map->red.begin + 2;
+        cursor[i].led = map->begin;
+        cursor[i].n = span(map);
+    }
+
+    advance();
+    return true;
+}
+
+void led_stream(uint16_t index, uint32_t bytes)
+{
+    /* Render the LEDs whose triplet is completed by the byte at index, with
+    the last three bytes received in bytes */
+    if (index != due)
+        return;
+
+    for (uint8_t i = 0; i < ncursors; i++) {
+        if (!cursor[i].n || cursor[i].next != index)
+            continue;
+
+        const struct led_map_t *map = &config.leds.map[cursor[i].map];
+        if (cursor[i].led >= limit) {
+            cursor[i].n = 0;
+            continue;
+        }
+
+        const uint8_t r = bytes >> 16;
+        const uint8_t g = bytes >> 8;
+        const uint8_t b = bytes;
+        if (map->flags & MAP_CMY)
+            transpose(cursor[i].led, map->string, scale(~r, ~g, ~b));
+        else
+            transpose(cursor[i].led, map->string, scale(r, g, b));
+
+        cursor[i].n--;
+        cursor[i].led += map->step;
+        cursor[i].next += map->red.step;
+    }
+
+    advance();
+}
+
+void led_stream_end(void)
+{
+#ifndef LED_RING
+    /* Restore the LEDs of the front plane that this frame has fallen short of */
+    for (uint8_t i = 0; i < ncursors; i++) {
+        const struct led_map_t *map = &config.leds.map[cursor[i].map];
+        const uint16_t done = span(map) - cursor[i].n;
+        if (skipped && cursor[i].shown > done) {
+            const uint32_t mask = 0x01010101 * ((uint32_t) 1 << (map->string + 2));
+            uint16_t led = map->begin + done * map->step;
+            for (uint16_t k = done; k < cursor[i].shown && led < limit; k++) {
+                const uint32_t *p = (const uint32_t *) &front[led * 3 * 8];
+                uint32_t *q = (uint32_t *) &back[led * 3 * 8];
+                for (uint8_t j = 0; j < 6; j++)
+                    q[j] = (q[j] & ~mask) | (p[j] & mask);
+                led += map->step;
+            }
+        }
+
+        cursor[i].shown = done;
+    }
+#endif
+
+    led_release();
+}
+
 void led_configure(void)
 {
+    led_compile();
+    led_gamma(config.leds.gamma);
     led_dim(config.leds.red, config.leds.green, config.leds.blue);
     led_length(config.leds.length);
     led_framerate(config.leds.framerate);
@@ -641,9 +1879,21 @@ void led_prepare(void)
     DMA1_Channel3->CPAR = (uint32_t) &GPIOB->BSRR;
 
     NVIC_DisableIRQ(DMA1_Channel2_IRQn);
+#ifndef LED_RING
     DMA1_Channel2->CCR = DMA_CCR2_PSIZE_1 | DMA_CCR2_MINC | DMA_CCR2_DIR;
     DMA1_Channel2->CNDTR = 0;
-    DMA1_Channel2->CMAR = (uint32_t) &bits;
+    DMA1_Channel2->CMAR = (uint32_t) front;
+#else
+    DMA1_Channel2->CCR =
+        DMA_CCR2_PSIZE_1 |
+        DMA_CCR2_MINC |
+        DMA_CCR2_CIRC |
+        DMA_CCR2_DIR |
+        DMA_CCR2_HTIE |
+        DMA_CCR2_TCIE;
+    DMA1_Channel2->CNDTR = 0;
+    DMA1_Channel2->CMAR = (uint32_t) ring;
+#endif
     DMA1_Channel2->CPAR = (uint32_t) &GPIOB->BRR;
 
     NVIC_DisableIRQ(DMA1_Channel6_IRQn);
@@ -668,8 +1918,20 @@ void led_prepare(void)
     TIM4->CNT = TIM4->ARR;
 
     nbits = MAXBITS;
+    count = MAXLEDS;
     capture = false;
+    defer = false;
     led_clear();
 
+    /* End of reset interrupt for deferred universes */
+    TIM3->SR = 0;
+    NVIC_EnableIRQ(TIM3_IRQn);
+
+#ifdef LED_RING
+    /* Ring re-encoding */
+    DMA1->IFCR = DMA_IFCR_CGIF2;
+    NVIC_EnableIRQ(DMA1_Channel2_IRQn);
+#endif
+
     led_configure();
 }
@@ -21,6 +21,12 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdint.h>
 #include <stdbool.h>
 
+/* Ring buffered output.
+Instead of keeping the complete bit pattern in RAM only 3 bytes are stored per
+LED and the bit pattern is generated on the fly during transmission. */
+//#define LED_RING
+
+#ifndef LED_RING
 /* Maximum number of LEDs per string */
 #ifndef DEBUG
 #define MAXLEDS 500
@@ -29,12 +35,32 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define MAXLEDS 300
 #endif
 
+#else
+/* Number of LEDs in the pool shared by all strings. This takes the same amount
+of RAM as the bit pattern for MAXLEDS in the plain mode. */
+#ifndef DEBUG
+#define MAXPOOL 3840
+#else
+#define MAXPOOL 2400
+#endif
+
+/* Maximum number of LEDs per string, provided that only three strings are used */
+#define MAXLEDS (MAXPOOL / 3)
+#endif
+
+/* Maximum size of a frame that is streamed to all strings */
+#define MAXFRAME (6 * MAXLEDS * 3)
+
+/* Upper limit of the frame rate, the actual limit depends on the string length */
+#define MAXFPS 1000
 
 void led_universe(void);
 bool led_busy(void);
 
 void led_cmy(uint16_t offset, uint8_t string, uint8_t cyan, uint8_t magenta, uint8_t yellow);
 void led_rgb(uint16_t offset, uint8_t string, uint8_t red, uint8_t green, uint8_t blue);
+void led_pixel(uint16_t offset, uint8_t string, uint8_t red, uint8_t green, uint8_t blue);
+void led_row(uint16_t offset, uint8_t rgb[6][3]);
 void led_clear(void);
 
 #define MAP_STATIC_RED          0x01
@@ -47,6 +73,7 @@ struct led_map_t {
     uint16_t begin;
     uint16_t end;
     int8_t step;
+    uint8_t flags;
 
     struct {
         uint16_t begin;
@@ -54,20 +81,27 @@ struct led_map_t {
         int8_t step;
         uint8_t value;
     } red, green, blue;
-
-    uint8_t flags;
 };
 
 void led_map(struct led_map_t *restrict map);
 void led_maps(void);
+void led_compile(void);
+
+bool led_stream_begin(void);
+void led_stream(uint16_t index, uint32_t bytes);
+void led_stream_end(void);
 
-void led_framerate(uint16_t fps);
+uint16_t led_framerate(uint16_t fps);
+uint16_t led_rate(void);
+uint16_t led_missed(void);
 void led_enable(bool enable);
 void led_length(uint16_t length);
 void led_dim(uint8_t red, uint8_t green, uint8_t blue);
+void led_gamma(uint8_t tenths);
 
 bool led_capture(void);
 void led_release(void);
+void led_sync(void);
 
 void led_configure(void);
 void led_prepare(void);
@@ -35,6 +35,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "tty.h"
 #include "sd.h"
 #include "ui.h"
+#include "record.h"
 
 #include "main.h"
 
@@ -95,6 +96,28 @@ void HardFault_Handler(void)
 
 
 static uint8_t index = 0;
+static void (*task)(void) = 0;
+
+static void wheel(uint8_t pos, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+    if (pos < 85) {
+        *r = 255 - pos * 3;
+        *g = 0;
+        *b = pos * 3;
+    }
+    else if (pos < 170) {
+        pos -= 85;
+        *r = 0;
+        *g = pos * 3;
+        *b = 255 - pos * 3;
+    }
+    else {
+        pos -= 170;
+        *r = pos * 3;
+        *g = 255 - pos * 3;
+        *b = 0;
+    }
+}
 
 /** Standalone mode.
 In this mode a range of test patterns as well as DMX input is provided:
@@ -135,31 +158,17 @@ static void standalone_task(void)
     /* Color rainbows */
     case '1':
         for (uint16_t i = 0; i < MAXLEDS; i++) {
-            uint8_t pos = index + i;
-            if (pos < 85) {
-                r = 255 - pos * 3;
-                g = 0;
-                b = pos * 3;
-            }
-            else if (pos < 170) {
-                pos -= 85;
-                r = 0;
-                g = pos * 3;
-                b = 255 - pos * 3;
-            }
-            else {
-                pos -= 170;
-                r = pos * 3;
-                g = 255 - pos * 3;
-                b = 0;
-            }
-
-            led_rgb(i, 0, r, g, b);
-            led_rgb(i, 1, r, 0, 0);
-            led_rgb(i, 2, 0, g, 0);
-            led_rgb(i, 3, 0, 0, b);
-            led_rgb(i, 4, r, r, r);
-            led_rgb(MAXLEDS - 1 - i, 5, r, g, b);
+            uint8_t rgb[6][3];
+            wheel(index + i, &r, &g, &b);
+            rgb[0][0] = r; rgb[0][1] = g; rgb[0][2] = b;
+            rgb[1][0] = r; rgb[1][1] = 0; rgb[1][2] = 0;
+            rgb[2][0] = 0; rgb[2][1] = g; rgb[2][2] = 0;
+            rgb[3][0] = 0; rgb[3][1] = 0; rgb[3][2] = b;
+            rgb[4][0] = r; rgb[4][1] = r; rgb[4][2] = r;
+
+            /* Reverse direction */
+            wheel(index + MAXLEDS - 1 - i, &rgb[5][0], &rgb[5][1], &rgb[5][2]);
+            led_row(i, rgb);
         }
         break;
 
@@ -169,23 +178,35 @@ static void standalone_task(void)
     case '4': b = 10; goto unicolor;
     case '5': r = g = b = 255; goto unicolor;
     unicolor:
-        for (uint16_t i = 0; i < MAXLEDS; i++) {
-            for (uint8_t string = 0; string < 6; string++)
-                led_rgb(i, string, r, g, b);
+    {
+        uint8_t rgb[6][3];
+        for (uint8_t string = 0; string < 6; string++) {
+            rgb[string][0] = r;
+            rgb[string][1] = g;
+            rgb[string][2] = b;
         }
 
+        for (uint16_t i = 0; i < MAXLEDS; i++)
+            led_row(i, rgb);
+
         break;
     }
+    }
 
     led_release();
     ui_led(index++ & 1);
 }
 
+static void dmx_task(void);
+
 /** Direct TPM2 input mode.
      9      direct TPM2 input:
                 string 1:   Every three consecutive bytes in the TPM2 data
                             stream map to the red, green and blue intensities
                             respectively of the LEDs.
+
+The baud rate is sensed from the line. If DMX is sensed instead the input
+switches to DMX, keeping the maps of the mode, and vice versa.
 */
 static void tpm2_task(void)
 {
@@ -200,6 +221,9 @@ static void tpm2_task(void)
                 ui_led(index++ & 1);
             }
         }
+
+        tp2_answer();
+        led_sync();
     }
     else {
         if (led_capture()) {
@@ -208,6 +232,12 @@ static void tpm2_task(void)
 
             ui_led(false);
         }
+
+        if (tp2_dmx()) {
+            tp2_enable(false);
+            dmx_enable(true);
+            task = &dmx_task;
+        }
     }
 }
 
@@ -234,6 +264,7 @@ static void dmx_task(void)
     if (dmx_detect()) {
         if (dmx_trip()) {
             if (led_capture()) {
+                rec_universe(rbuf, MAXDMX);
                 led_maps();
                 led_release();
                 dmx_clear();
@@ -249,7 +280,44 @@ static void dmx_task(void)
 
             ui_led(false);
         }
+
+        if (dmx_tpm2()) {
+            dmx_enable(false);
+            tp2_enable(true);
+            task = &tpm2_task;
+        }
+    }
+}
+
+/** Record mode.
+The input is displayed as in TPM2 mode and recorded to the file /recordX.tp2 on
+the SD card, X being the position of the hex switch. Position 0 stops the
+recording.
+*/
+static void record_task(void)
+{
+    static void (*input)(void) = &tpm2_task;
+    static uint8_t slot = 0;
+    uint8_t hex = ui_hex();
+    if (hex <= '9')
+        hex = hex - '0';
+    else
+        hex = hex - 'A' + 10;
+
+    if (slot != hex) {
+        rec_stop();
+        slot = hex;
+        if (slot)
+            rec_start(slot);
     }
+
+    rec_flush();
+
+    /* The input tasks switch between TPM2 and DMX by replacing the task */
+    task = input;
+    (*input)();
+    input = task;
+    task = &record_task;
 }
 
 static void scene_task(void)
@@ -299,10 +367,12 @@ static void beacon_task(void)
 
         index++;
         ui_led(index & 1);
-        for (uint16_t i = 0; i < MAXLEDS; i++) {
-            for (uint8_t string = 0; string < 6; string++)
-                led_rgb(i, string, (index & 1) ? 16 : 0, 0, 0);
-        }
+        uint8_t rgb[6][3] = {{ 0 }};
+        for (uint8_t string = 0; string < 6; string++)
+            rgb[string][0] = (index & 1) ? 16 : 0;
+
+        for (uint16_t i = 0; i < MAXLEDS; i++)
+            led_row(i, rgb);
 
         led_release();
     }
@@ -370,6 +440,7 @@ int main(void)
                 };
 
                 config.leds.map[1].string = 0xFF;
+                led_compile();
 
                 led_framerate(0);
                 led_dim(0xFF, 0xFF, 0xFF);
@@ -458,6 +529,7 @@ int main(void)
                 };
 
                 config.leds.map[6].string = 0xFF;
+                led_compile();
 
                 led_framerate(0);
                 led_dim(0xFF, 0xFF, 0xFF);
@@ -472,7 +544,6 @@ int main(void)
         }
     }
 
-    void (*task)(void) = 0;
     switch (mode) {
         default:
         case standalone_mode:
@@ -489,7 +560,7 @@ int main(void)
             tp2_enable(true);
             tty_enable(true);
             led_enable(true);
-            task = tpm2_task;
+            task = &tpm2_task;
             break;
 
         case dmx_mode:
@@ -499,6 +570,13 @@ int main(void)
             task = &dmx_task;
             break;
 
+        case record_mode:
+            tp2_enable(true);
+            tty_enable(true);
+            led_enable(true);
+            task = &record_task;
+            break;
+
         /* RF modes with SD card only */
         case tx_mode:
             rf_nodeid(0);
@@ -0,0 +1,300 @@
+/** This file is part of ipled - a versatile LED strip controller.
+Copyright (C) 2024 Sven Pauli <sven@knst-wrk.de>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/** Recording.
+The input of the serial port is written to a file on the SD card while it is
+being displayed, so a show improvised live can be replayed later.
+
+The file is preallocated in one piece when the recording starts, and its
+sectors are written past FatFs by one multiple block write that lets the card
+pre-erase them, see sd_stream(). TPM2 data is tapped from the decoder frame by
+frame and put into a ring of REC_RING sectors. The main
+loop passes every complete sector on to the card by rec_flush() as soon as the
+card is ready, so the ring absorbs the time the card is busy programming. DMX
+universes are recorded as TPM2 data blocks.
+
+A frame is only passed on once the next one starts. If it does not fit into the
+ring it is dropped as a whole, as is any frame longer than the ring. The
+frames dropped are counted, and the count is recorded as a gap before the next
+frame that fits.
+The RAM left holds only a few sectors, 20ms of input at 500kbaud for a ring of
+two. The pre-erase keeps the card busy for less than that between sectors as a
+rule, so gaps are left only by the rare longer stalls of a card. The last gap
+of a file tells how well the card is suited.
+
+Timestamps are inserted as command blocks before every frame that starts
+between two blocks, carrying the milliseconds since the start of the recording.
+Gaps are command blocks carrying the number of frames dropped so far:
+
+    0xC9 0xC0 0x00 0x05  0x03 <t3> <t2> <t1> <t0>  0x36
+    0xC9 0xC0 0x00 0x05  0x04 <n3> <n2> <n1> <n0>  0x36
+
+When the file is played back the frames are held until their time has come.
+The file is truncated to the length recorded once the recording is stopped.
+Until then it keeps the size it has been preallocated with.
+*/
+
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cmsis/stm32f10x.h"
+
+#include "ff/ff.h"
+
+#include "timeout.h"
+#include "tpm2.h"
+#include "sd.h"
+#include "scene.h"
+
+#include "record.h"
+
+#if (REC_RING < 2) || (REC_RING > 8)
+#   error Invalid ring size (2 .. 8 sectors)
+#endif
+
+#if (REC_SIZE < 512) || (REC_SIZE > 0xFFFFFFFFUL - REC_RING * 512UL)
+#   error Invalid file size
+#endif
+
+#if REC_RING > SC_PREFETCH
+#   error Ring exceeds the memory of the scenes
+#endif
+
+/* Size of the ring in bytes */
+#define RING                (REC_RING * 512U)
+
+static uint8_t (*ring)[512];
+static volatile uint32_t written;
+static uint32_t staged;
+static uint32_t flushed;
+static bool dropping;
+static uint32_t drops;
+static uint32_t marked;
+static uint32_t marking;
+
+static bool recording;
+static char name[] = "/record0.tp2";
+static uint32_t sectors;
+static timeout_t origin;
+static uint32_t last;
+
+static bool put(const uint8_t *data, size_t n)
+{
+    /* Append to the frame staged unless the ring is too full */
+    const uint32_t s = staged;
+    if (RING - (s - flushed) < n)
+        return false;
+
+    uint8_t *r = &ring[0][0];
+    const uint16_t p = s % RING;
+    const size_t k = (n < RING - p) ? n : RING - p;
+    memcpy(&r[p], data, k);
+    memcpy(r, &data[k], n - k);
+    staged = s + n;
+    return true;
+}
+
+static bool command(uint8_t c, uint32_t arg)
+{
+    const uint8_t block[] = {
+        0xC9, 0xC0, 0x00, 0x05,
+        c, arg >> 24, arg >> 16, arg >> 8, arg >> 0,
+        0x36
+    };
+    return put(block, sizeof(block));
+}
+
+static void drop(void)
+{
+    /* Discard the frame staged */
+    staged = written;
+    dropping = true;
+    drops++;
+}
+
+static bool begin(void)
+{
+    /* Pass on the last frame and start the next one with a gap, if frames
+    have been dropped, and a timestamp unless the time has not advanced */
+    if (!dropping) {
+        written = staged;
+        marked = marking;
+    }
+    dropping = false;
+
+    if (drops != marked) {
+        if (!command(0x04, drops)) {
+            drop();
+            return false;
+        }
+        marking = drops;
+    }
+
+    const uint32_t t = tot_set(0) - origin;
+    if (t != last) {
+        if (!command(0x03, t)) {
+            drop();
+            return false;
+        }
+        last = t;
+    }
+
+    return true;
+}
+
+static void tap(const uint8_t *data, size_t n, bool aligned)
+{
+    /* Called from interrupt context */
+    if (aligned)
+        begin();
+    if (!dropping && !put(data, n))
+        drop();
+}
+
+void rec_universe(const uint8_t *data, uint16_t n)
+{
+    /* DMX universe as a TPM2 data block */
+    if (!recording)
+        return;
+
+    const uint8_t header[] = { 0xC9, 0xDA, n >> 8, n >> 0 };
+    const uint8_t end = 0x36;
+    if (begin() && !(put(header, sizeof(header)) && put(data, n) && put(&end, 1)))
+        drop();
+}
+
+static bool drain(void)
+{
+    /* Pass complete sectors on to the card as long as it is ready. Fails if
+    the card does or if the file is full. */
+    while (written - flushed >= 512) {
+        if (flushed / 512 == sectors)
+            return false;
+
+        if (!sd_ready())
+            return true;
+
+        if (!sd_append(ring[(flushed / 512) % REC_RING]))
+            return false;
+
+        flushed += 512;
+    }
+
+    return true;
+}
+
+bool rec_flush(void)
+{
+    if (!recording)
+        return false;
+
+    if (!drain()) {
+        rec_stop();
+        return false;
+    }
+
+    return true;
+}
+
+bool rec_start(uint8_t slot)
+{
+    /* Record to /recordX.tp2, X being the hexadecimal slot */
+    rec_stop();
+    name[7] = (slot < 10) ? '0' + slot : 'A' + slot - 10;
+
+    FIL f;
+    if (f_open(&f, name, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+        return false;
+
+    /* Preallocate the file in one piece */
+    FSIZE_t size = REC_SIZE;
+    while (f_expand(&f, size, 1) != FR_OK) {
+        size /= 2;
+        if (size < 512) {
+            f_close(&f);
+            return false;
+        }
+    }
+
+    const FATFS *fs = f.obj.fs;
+    const LBA_t sector = fs->database + (LBA_t) (f.obj.sclust - 2) * fs->csize;
+    if (f_close(&f) != FR_OK)
+        return false;
+
+    sectors = size / 512;
+    if (!sd_stream(sector, sectors))
+        return false;
+
+    ring = sc_memory();
+    written = 0;
+    staged = 0;
+    flushed = 0;
+    dropping = false;
+    drops = 0;
+    marked = 0;
+    marking = 0;
+    origin = tot_set(0);
+    last = UINT32_MAX;
+    recording = true;
+    tp2_tap(&tap);
+    return true;
+}
+
+void rec_stop(void)
+{
+    if (!recording)
+        return;
+
+    /* Pass on what is left in the ring, padding the last sector */
+    recording = false;
+    tp2_tap(0);
+    if (!dropping)
+        written = staged;
+    if (drops != marked && command(0x04, drops))
+        written = staged;
+    uint32_t length = written;
+    const timeout_t timeout = tot_set(REC_RING * SD_WRITE_TIMEOUT);
+    bool ok = true;
+    while (ok && written - flushed >= 512 && !tot_expired(timeout))
+        ok = drain();
+
+    if (written - flushed < 512) {
+        const uint8_t zero[16] = { 0 };
+        while (staged % 512) {
+            const uint16_t k = 512 - staged % 512;
+            put(zero, (k < sizeof(zero)) ? k : sizeof(zero));
+        }
+        written = staged;
+
+        while (ok && written != flushed && !tot_expired(timeout))
+            ok = drain();
+    }
+    sd_finish();
+
+    /* Truncate to the length recorded */
+    if (length > flushed)
+        length = flushed;
+
+    FIL f;
+    if (f_open(&f, name, FA_OPEN_EXISTING | FA_WRITE) == FR_OK) {
+        if (f_lseek(&f, length) == FR_OK)
+            f_truncate(&f);
+        f_close(&f);
+    }
+}
@@ -0,0 +1,40 @@
+/** This file is part of ipled - a versatile LED strip controller.
+Copyright (C) 2024 Sven Pauli <sven@knst-wrk.de>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Number of sectors in the ring that absorbs the input while the card is busy.
+The ring takes the memory of the scenes, so it holds up to SC_PREFETCH sectors.
+Two sectors hold 20ms of input at 500kbaud. */
+#define REC_RING                    2
+
+/* Size of the file preallocated for a recording in bytes, halved until it fits.
+2GB last about 11 hours at 500kbaud. */
+#define REC_SIZE                    (2048UL * 1024 * 1024)
+
+bool rec_start(uint8_t slot);
+void rec_stop(void);
+bool rec_flush(void);
+
+void rec_universe(const uint8_t *data, uint16_t n);
+
+#endif
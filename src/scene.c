@@ -23,17 +23,38 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "config.h"
 #include "tpm2.h"
 #include "leds.h"
+#include "sd.h"
 #include "timeout.h"
 
 #include "scene.h"
 
+#if (SC_PREFETCH < 2) || (SC_PREFETCH > 8)
+#   error Invalid prefetch depth
+#endif
+
 static union
 {
     struct {
-        uint8_t buf[128];
+        uint8_t buf[SC_PREFETCH][512];
         FIL f;
         UINT br;
         UINT bp;
+
+        /* Raw reading */
+        bool raw;
+        DWORD clmt[2 * SC_FRAGMENTS + 2];
+        const DWORD *frag;
+        LBA_t sector;
+        DWORD run;
+        FSIZE_t left;
+        UINT size[SC_PREFETCH];
+        uint8_t head;
+        uint8_t queued;
+
+        /* Recorded timing */
+        bool timed;
+        timeout_t origin;
+        timeout_t due;
     } tpm2;
 
     struct {
@@ -80,6 +101,12 @@ static FSIZE_t pos;
 /* command < 0 ---> paused */
 static int command;
 
+static volatile bool failed;
+
+/* Prefetch statistics */
+static uint8_t reserve;
+static uint16_t underruns;
+
 
 /******************************************************************************
  * Stop
@@ -102,10 +129,91 @@ void sc_do_stop(void)
 
 /******************************************************************************
  * TPM2
+ *
+ * Files of up to SC_FRAGMENTS fragments are read raw, bypassing FatFs. The
+ * sectors are read from the card into a ring of SC_PREFETCH sectors in the
+ * background. One of them is being digested while the others are loaded
+ * whenever the card is idle, so a slow sector is absorbed by those already
+ * read ahead. Only the last sector queued may still be in flight, the sectors
+ * before it are digested right away.
+ * The ring holds raw TPM2 data rather than decoded frames. A decoded frame of
+ * MAXLEDS LEDs on six strings takes MAXFRAME bytes, more than the RAM left,
+ * while a raw sector of a compressed file holds several of them. The LED
+ * planes hold the frame being shown, and the frame tick takes the next one as
+ * soon as it has been decoded.
+ * The least number of sectors that were ready ahead and the frame ticks that
+ * have passed without a new frame are kept to size the ring.
+ *
+ * Frames of recorded files are held until the time of their timestamp has come,
+ * counting from the first one.
  */
+static void arrived(bool ok)
+{
+    if (!ok)
+        failed = true;
+}
+
+static bool prefetch(void)
+{
+    /* Load the next sector of the file into a free slot while the card is idle */
+    if (!arg.tpm2.left || arg.tpm2.queued + 1 >= SC_PREFETCH || sd_busy())
+        return true;
+
+    const uint8_t slot = (arg.tpm2.head + arg.tpm2.queued) % SC_PREFETCH;
+
+    if (!arg.tpm2.run) {
+        /* Next fragment */
+        const FATFS *fs = arg.tpm2.f.obj.fs;
+        if (!arg.tpm2.frag[0])
+            return false;
+
+        arg.tpm2.run = arg.tpm2.frag[0] * fs->csize;
+        arg.tpm2.sector = fs->database + (LBA_t) (arg.tpm2.frag[1] - 2) * fs->csize;
+        arg.tpm2.frag += 2;
+    }
+
+    const UINT size = (arg.tpm2.left < 512) ? arg.tpm2.left : 512;
+    arg.tpm2.size[slot] = size;
+    arg.tpm2.left -= size;
+    arg.tpm2.run--;
+    arg.tpm2.queued++;
+    return sd_read_async(arg.tpm2.sector++, arg.tpm2.buf[slot], 1, &arrived);
+}
+
+static bool load(void)
+{
+    /* Continue with the next sector, the last one queued may still be loading */
+    if (!arg.tpm2.queued)
+        return true;
+
+    const uint8_t ready = arg.tpm2.queued - (sd_busy() ? 1 : 0);
+    if (ready < reserve)
+        reserve = ready;
+
+    if (!ready)
+        while (sd_busy());
+
+    if (failed)
+        return false;
+
+    const uint8_t slot = arg.tpm2.head;
+    arg.tpm2.head = (slot + 1) % SC_PREFETCH;
+    arg.tpm2.queued--;
+    arg.tpm2.bp = slot * 512;
+    arg.tpm2.br = arg.tpm2.size[slot];
+    return prefetch();
+}
+
 static bool play_tpm2(void)
 {
+    underruns += led_missed();
+    if (arg.tpm2.raw && !prefetch())
+        return false;
+
     if (tp2_trip()) {
+        if (arg.tpm2.timed && !tot_expired(arg.tpm2.due))
+            return true;
+
         /* Synchronize to frame generator */
         if (led_capture()) {
             led_maps();
@@ -118,18 +226,33 @@ static bool play_tpm2(void)
         /* Digest more TPM2 data until one frame is complete */
         do {
             if (!arg.tpm2.br) {
-                arg.tpm2.bp = 0;
-                arg.tpm2.br = sizeof(arg.tpm2.buf)/sizeof(*arg.tpm2.buf);
-                if (f_read(&arg.tpm2.f, arg.tpm2.buf, arg.tpm2.br, &arg.tpm2.br) != FR_OK)
-                    return false;
+                if (arg.tpm2.raw) {
+                    if (!load())
+                        return false;
+                }
+                else {
+                    arg.tpm2.bp = 0;
+                    arg.tpm2.br = sizeof(arg.tpm2.buf[0]);
+                    if (f_read(&arg.tpm2.f, arg.tpm2.buf[0], arg.tpm2.br, &arg.tpm2.br) != FR_OK)
+                        return false;
+                }
             }
 
-            size_t digested = tp2_digest(&arg.tpm2.buf[arg.tpm2.bp], arg.tpm2.br);
+            size_t digested = tp2_digest(&arg.tpm2.buf[0][arg.tpm2.bp], arg.tpm2.br);
             arg.tpm2.bp += digested;
             arg.tpm2.br -= digested;
             if (tp2_trip())
                 break;
-        } while (arg.tpm2.br || !f_eof(&arg.tpm2.f));
+        } while (arg.tpm2.br || (arg.tpm2.raw ? arg.tpm2.queued : !f_eof(&arg.tpm2.f)));
+
+        uint32_t t;
+        if (tp2_stamp(&t)) {
+            if (!arg.tpm2.timed) {
+                arg.tpm2.timed = true;
+                arg.tpm2.origin = tot_set(0) - t;
+            }
+            arg.tpm2.due = arg.tpm2.origin + t;
+        }
     }
 
     return tp2_trip();
@@ -138,6 +261,9 @@ static bool play_tpm2(void)
 static void stop_tpm2(void)
 {
     led_enable(false);
+
+    /* The sector in flight must land before the memory is passed on */
+    while (sd_busy());
     f_close(&arg.tpm2.f);
 }
 
@@ -150,6 +276,27 @@ void sc_do_tpm2(const char *const file)
     if (fr == FR_OK) {
         tp2_reset();
         arg.tpm2.br = 0;
+        arg.tpm2.timed = false;
+
+        /* Read raw if the link map of the file fits */
+        arg.tpm2.clmt[0] = sizeof(arg.tpm2.clmt)/sizeof(*arg.tpm2.clmt);
+        arg.tpm2.f.cltbl = arg.tpm2.clmt;
+        arg.tpm2.raw = (f_lseek(&arg.tpm2.f, CREATE_LINKMAP) == FR_OK);
+        if (arg.tpm2.raw) {
+            arg.tpm2.frag = &arg.tpm2.clmt[1];
+            arg.tpm2.run = 0;
+            arg.tpm2.left = f_size(&arg.tpm2.f);
+            arg.tpm2.head = 0;
+            arg.tpm2.queued = 0;
+            failed = false;
+            arg.tpm2.raw = prefetch();
+        }
+
+        if (!arg.tpm2.raw)
+            arg.tpm2.f.cltbl = 0;
+
+        /* Discard the frame ticks of preceding commands */
+        led_missed();
         command = tpm2_command;
     }
 }
@@ -321,6 +468,8 @@ bool sc_start(uint16_t s)
         /* Start scene */
         sc_skip();
         scene = s;
+        reserve = SC_PREFETCH - 1;
+        underruns = 0;
         pos = cfg_scene(scene);
         if (pos)
             pos = cfg_command(pos);
@@ -367,11 +516,28 @@ void sc_skip(void)
     }
 }
 
+void sc_statistics(uint8_t *depth, uint8_t *reserve_, uint16_t *underruns_)
+{
+    *depth = SC_PREFETCH;
+    *reserve_ = reserve;
+    *underruns_ = underruns;
+}
+
+
+void *sc_memory(void)
+{
+    /* Lend the memory of the commands, which holds SC_PREFETCH sectors, to
+    modes that play no scenes */
+    return &arg;
+}
+
 
 void sc_prepare(void)
 {
     scene = 0;
     pos = 0;
+    reserve = SC_PREFETCH - 1;
+    underruns = 0;
 
     command = stop_command;
 }
@@ -23,6 +23,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "ff/ff.h"
 
+/* Maximum number of fragments of TPM2 files that are read raw */
+#define SC_FRAGMENTS                4
+
+/* Number of sectors in the prefetch ring of raw TPM2 files, one of which is
+being digested while the others are loaded ahead. Each sector takes 512 bytes
+of RAM. */
+#define SC_PREFETCH                 2
+
 void sc_do_tpm2(const char *const file);
 void sc_do_pause(uint32_t t);
 void sc_do_map(FSIZE_t map_);
@@ -35,6 +43,8 @@ void sc_skip(void);
 void sc_stop(void);
 
 bool sc_play(void);
+void sc_statistics(uint8_t *depth, uint8_t *reserve, uint16_t *underruns);
+void *sc_memory(void);
 void sc_prepare(void);
 
 #endif
@@ -39,10 +39,37 @@ Data bits are clocked on the rising edge of the clock, with the clock being in
 low state when idle.
 
 DMA1 Channel 4 is used for reception and DMA1 Channel 5 is used for transfer.
+
+Reads may run in the background, see sd_read_async(). The command is sent right
+away unless the read continues the last one. Then the data token is polled
+byte by byte in the SPI interrupt at a low clock so as not to flood the CPU
+with interrupts, and the blocks are received by DMA. The SysTick does not
+advance within interrupts, so anything that may have to wait on the card for
+long, like retries or stopping a failed transmission, is left to the caller.
+For the same reason, a background read cannot complete while an interrupt is
+being handled, e.g. in the callback of sd_read_async(). Any access that would
+have to wait for it fails there instead.
+
+Sequential reads are sped up by leaving the multiple block read running after
+a read, so the next one may just carry on receiving blocks. Up to SD_READAHEAD
+sectors are read ahead into a cache in the background by sd_read(). This is
+off by default, as scene playback replaces it by a prefetch of its own that
+reads the TPM2 files raw with sd_read_async(). Any other access to the card
+stops the transmission first.
+
+Long sequential writes are streamed by sd_stream(), which announces the number
+of blocks to the card for pre-erasing and leaves the multiple block write
+running. The blocks are then passed one by one by sd_append() whenever
+sd_ready() tells the card has finished programming the last one, so the caller
+is not blocked while the card is busy. As these blocks are handed over to the
+driver they are permuted in place for the hardware CRC.
 */
 
+#include <string.h>
+
 #include "cmsis/stm32f10x.h"
 
+#include "tty.h"
 #include "timeout.h"
 
 #include "sd.h"
@@ -59,6 +86,9 @@ DMA1 Channel 4 is used for reception and DMA1 Channel 5 is used for transfer.
 #if (SD_RETRIES < 0) || (SD_RETRIES > 255)
 #   error Invalid number of retries (1 .. 255, 0 for infinite)
 #endif
+#if (SD_READAHEAD < 0) || (SD_READAHEAD > 8)
+#   error Invalid read-ahead (0 .. 8 sectors)
+#endif
 
 
 
@@ -68,6 +98,9 @@ DMA1 Channel 4 is used for reception and DMA1 Channel 5 is used for transfer.
 /* Max 25MHz */
 #define BR_TRANS                (0)
 
+/* Polling the data token in the background, about 14us per byte */
+#define BR_POLL                 (SPI_CR1_BR_2 | SPI_CR1_BR_0)
+
 
 /* Bit 0x80 is used to mark application commands, strip it thus */
 #define COMMAND_TOKEN(x)        (0x40 | ((x) & 0x3F))
@@ -145,6 +178,11 @@ No arguments. */
 #define CMD_CRC_ON_OFF          59
 #define CRC_ON                  0x01
 
+/* ACMD23 --> R1
+    22:0    number of blocks to be pre-erased before writing
+*/
+#define ACMD_SET_WR_BLK_ERASE_COUNT (0x80 | 23)
+
 /* ACMD41 --> R1
     30      host high capacity support (HCS)
             all other bits reserved ('0')
@@ -232,6 +270,37 @@ static uint8_t card_type;
 static bool high_density;
 static bool crc_enabled;
 
+static volatile bool reading;
+static volatile uint16_t remaining;
+static bool open;
+static volatile bool ahead;
+static bool shared;
+static uint8_t *target;
+static uint32_t address;
+static timeout_t expiry;
+static sd_done_t done;
+static bool broken;
+static bool writing;
+
+#if SD_READAHEAD
+static uint8_t cache[SD_READAHEAD][512];
+static uint32_t cached;
+static uint8_t ncached;
+#endif
+
+static uint8_t command(uint8_t index, uint32_t arg);
+
+static bool await(const volatile bool *flag)
+{
+    /* Wait for the read in the background to complete. This never happens
+    while handling an interrupt, so give up then. */
+    if (*flag && __get_IPSR())
+        return false;
+
+    while (*flag);
+    return true;
+}
+
 static uint8_t crc7(const uint8_t *data, uint16_t n)
 {
     /* 7 bit CRC for commands.
@@ -333,6 +402,19 @@ static bool select(bool s)
     make it release the MISO line. */
     flush();
     if (s) {
+        /* Let reads in the background complete */
+        if (!await(&reading))
+            return false;
+
+        /* Stop a transmission left running */
+        if (open) {
+            open = false;
+            broken = false;
+            command(CMD_STOP_TRANSMISSION, 0);
+            select(false);
+        }
+        sd_finish();
+
         /* Assert CS and discard first byte received */
         GPIOB->BSRR = GPIO_BSRR_BR12;
         if (ready(SD_SELECT_TIMEOUT))
@@ -413,7 +495,7 @@ static inline void reorder(uint8_t *data, uint16_t n)
 }
 
 /* Block length n must be a multiple of 2. */
-static bool rxblock(uint8_t *data, uint16_t n)
+static void rxstart(uint8_t *data, uint16_t n, bool irq)
 {
 #ifdef SD_HARDWARE_CRC
     /* Switch to 16bit mode with CRC */
@@ -429,8 +511,11 @@ static bool rxblock(uint8_t *data, uint16_t n)
     GPIOB->CRH &= ~GPIO_CRH_CNF15_1;
 #endif
 
-    /* Set up DMA transfers */
-    uint16_t dummy = 0xFFFF;
+    /* Set up DMA transfers.
+    DMA1 channel 5 is shared with the reception of the UART. */
+    static const uint16_t dummy = 0xFFFF;
+    shared = tty_dma(false);
+    DMA1_Channel5->CPAR = (uint32_t) &SPI2->DR;
     DMA1_Channel5->CMAR = (uint32_t) &dummy;
     DMA1_Channel5->CNDTR = n;
     DMA1_Channel4->CMAR = (uint32_t) data;
@@ -447,6 +532,7 @@ static bool rxblock(uint8_t *data, uint16_t n)
         DMA_CCR4_MSIZE_0 |
         DMA_CCR4_PSIZE_0 |
         DMA_CCR4_MINC |
+        (irq ? DMA_CCR4_TCIE : 0) |
         DMA_CCR4_EN;
 #else
     DMA1_Channel5->CCR =
@@ -454,15 +540,20 @@ static bool rxblock(uint8_t *data, uint16_t n)
         DMA_CCR5_EN;
     DMA1_Channel4->CCR =
         DMA_CCR4_MINC |
+        (irq ? DMA_CCR4_TCIE : 0) |
         DMA_CCR4_EN;
 #endif
 
     /* Transfer */
     DMA1->IFCR = DMA_IFCR_CTCIF5 | DMA_IFCR_CTCIF4;
     SPI2->CR2 |= SPI_CR2_TXDMAEN | SPI_CR2_RXDMAEN;
+}
 
-    /* Wait for DMA to complete */
-    while ( (DMA1->ISR & (DMA_ISR_TCIF5 | DMA_ISR_TCIF4)) != (DMA_ISR_TCIF5 | DMA_ISR_TCIF4) );
+static bool rxfinish(uint8_t *data, uint16_t n)
+{
+#ifdef SD_HARDWARE_CRC
+    n /= 2;
+#endif
 
     /* Wait for SPI to complete and halt DMA */
     while (!(SPI2->SR & SPI_SR_TXE));
@@ -470,7 +561,9 @@ static bool rxblock(uint8_t *data, uint16_t n)
     SPI2->CR2 &= ~(SPI_CR2_TXDMAEN | SPI_CR2_RXDMAEN);
     DMA1_Channel5->CCR = 0;
     DMA1_Channel4->CCR = 0;
+    DMA1->IFCR = DMA_IFCR_CGIF5 | DMA_IFCR_CGIF4;
     __DSB();
+    tty_dma(shared);
 
 #ifdef SD_HARDWARE_CRC
     /* DMA will take care of CRCNEXT */
@@ -494,15 +587,51 @@ static bool rxblock(uint8_t *data, uint16_t n)
 #endif
 }
 
-static void txblock(const uint8_t *data, uint16_t n)
+static bool rxblock(uint8_t *data, uint16_t n)
+{
+    rxstart(data, n, false);
+
+    /* Wait for DMA to complete */
+    while ( (DMA1->ISR & (DMA_ISR_TCIF5 | DMA_ISR_TCIF4)) != (DMA_ISR_TCIF5 | DMA_ISR_TCIF4) );
+    return rxfinish(data, n);
+}
+
+/* Block length n must be a multiple of 2. Data that may be permutated is sent
+with the hardware CRC. */
+static void txblock(const uint8_t *data, uint16_t n, bool permute)
 {
-    /* Set up DMA transfers */
+#ifdef SD_HARDWARE_CRC
+    if (permute) {
+        /* Switch to 16bit mode with CRC, the words are sent MSB first */
+        reorder((uint8_t *) data, n / 2);
+        SPI2->CR1 &= ~SPI_CR1_SPE;
+        SPI2->CR1 |= SPI_CR1_DFF | SPI_CR1_CRCEN | SPI_CR1_SPE;
+        n /= 2;
+    }
+#else
+    (void) permute;
+#endif
+
+    /* Set up DMA transfers.
+    DMA1 channel 5 is shared with the reception of the UART. */
+    const bool dma = tty_dma(false);
+    DMA1_Channel5->CPAR = (uint32_t) &SPI2->DR;
     DMA1_Channel5->CMAR = (uint32_t) data;
     DMA1_Channel5->CNDTR = n;
     __DSB();
 
+#ifdef SD_HARDWARE_CRC
+    if (permute)
+        DMA1_Channel5->CCR =
+            DMA_CCR5_MSIZE_0 |
+            DMA_CCR5_PSIZE_0 |
+            DMA_CCR5_MINC |
+            DMA_CCR5_DIR |
+            DMA_CCR5_EN;
+    else
+#endif
     DMA1_Channel5->CCR =
-        DMA_CCR4_MINC |
+        DMA_CCR5_MINC |
         DMA_CCR5_DIR |
         DMA_CCR5_EN;
 
@@ -519,6 +648,17 @@ static void txblock(const uint8_t *data, uint16_t n)
     SPI2->CR2 &= ~SPI_CR2_TXDMAEN;
     DMA1_Channel5->CCR = 0;
     __DSB();
+    tty_dma(dma);
+
+#ifdef SD_HARDWARE_CRC
+    if (permute) {
+        /* DMA has taken care of CRCNEXT, switch back to 8bit mode */
+        SPI2->CR1 &= ~SPI_CR1_SPE;
+        SPI2->CR1 &= ~(SPI_CR1_DFF | SPI_CR1_CRCEN);
+        SPI2->CR1 |= SPI_CR1_SPE;
+        return;
+    }
+#endif
 
     /* Cannot use hardware CRC because the const data array must not be
     permutated. */
@@ -537,7 +677,7 @@ static uint8_t command(uint8_t index, uint32_t arg)
     if (index & 0x80) {
         /* Announce application command if needed */
         index &= ~0x80;
-        if (command(CMD_APP_CMD, 0) != R1_IDLE)
+        if (command(CMD_APP_CMD, 0) & ~R1_IDLE)
             return 0xFF;
     }
 
@@ -608,79 +748,174 @@ static uint32_t response(void)
 }
 
 
-bool sd_read(uint32_t sector, uint8_t *data, uint16_t n)
+static void conclude(bool ok)
 {
-    if (!n)
-        return true;
+    /* End the read and report its result. Nothing else can take the card
+    before this returns.
+    This runs in interrupt context, where the SysTick does not advance, so a
+    failed transmission is not stopped here but marked broken. The next access
+    stops it by select(). */
+    reading = false;
+#if SD_READAHEAD
+    if (ahead)
+        ncached = SD_READAHEAD - remaining;
+#endif
+    ahead = false;
+    if (!ok)
+        broken = true;
 
-    if (!high_density)
-        sector *= 512;
+    if (done)
+        done(ok);
+}
 
-    if (!select(true))
-        return false;
+static void poll(void)
+{
+    /* Wait for the data token in the background */
+    flush();
+    expiry = tot_set(SD_READ_TIMEOUT);
+    SPI2->CR1 = (SPI2->CR1 & ~SPI_CR1_BR) | BR_POLL;
+    SPI2->CR2 |= SPI_CR2_RXNEIE;
+    SPI2->DR = 0xFF;
+}
 
-    if (n > 1) {
-        /* Multiple sector read */
-#if SD_RETRIES
-        for (uint8_t retry = SD_RETRIES; retry > 0; retry--) {
-#else
-        for (;;) {
-#endif
-            if (command(CMD_READ_MULTIPLE_BLOCK, sector) != 0)
-                break;
+static void fetch(uint8_t *data, uint16_t n)
+{
+    /* Receive n blocks of the running transmission in the background */
+    target = data;
+    remaining = n;
+    reading = true;
+    poll();
+}
 
-            uint8_t *p = data;
-            for (uint16_t i = 0; i < n; i++) {
-                if (rxtoken(SD_READ_TIMEOUT) == DATA_TOKEN(DATA_SINGLE_READ)) {
-                    if (rxblock(p, 512)) {
-                        p += 512;
-                        continue;
-                    }
-                }
+void SPI2_IRQHandler(void) __USED;
+void SPI2_IRQHandler(void)
+{
+    const uint8_t token = SPI2->DR;
+    if (token == 0xFF && !tot_expired(expiry)) {
+        SPI2->DR = 0xFF;
+        return;
+    }
 
-                p = 0;
-                break;
-            }
+    SPI2->CR2 &= ~SPI_CR2_RXNEIE;
+    while (SPI2->SR & SPI_SR_BSY);
+    SPI2->CR1 = (SPI2->CR1 & ~SPI_CR1_BR) | BR_TRANS;
 
-            if (command(CMD_STOP_TRANSMISSION, 0) != 0)
-                break;
+    if (token == DATA_TOKEN(DATA_SINGLE_READ))
+        rxstart(target, 512, true);
+    else
+        conclude(false);
+}
 
-            if (p) {
-                select(false);
-                return true;
-            }
+void DMA1_Channel4_IRQHandler(void) __USED;
+void DMA1_Channel4_IRQHandler(void)
+{
+    /* Reception completes after transmission */
+    if (!rxfinish(target, 512)) {
+        conclude(false);
+        return;
+    }
 
-            /* Retry */
+    target += 512;
+    address += high_density ? 1 : 512;
+    if (--remaining)
+        poll();
+    else
+        conclude(true);
+}
+
+bool sd_read_async(uint32_t sector, uint8_t *data, uint16_t n, sd_done_t callback)
+{
+    /* Start reading n sectors in the background. The callback is invoked from
+    interrupt context once the read has completed or failed, see also
+    sd_busy() and sd_remaining(). Returns false if the read could not be
+    started, which is always the case from within the callback while the
+    read-ahead is still running.
+    The multiple block read is left running afterwards, so a read that
+    continues the last one carries on without another command. */
+    if (!n)
+        return false;
+
+    if (!await(&ahead) || reading)
+        return false;
+
+    const uint32_t a = high_density ? sector : sector * 512;
+    if (!open || broken || a != address) {
+        if (!select(true))
+            return false;
+
+        if (command(CMD_READ_MULTIPLE_BLOCK, a) != 0) {
             select(false);
-            select(true);
+            return false;
         }
+
+        open = true;
+        address = a;
     }
-    else {
-        /* Single sector read */
+
+    done = callback;
+    fetch(data, n);
+    return true;
+}
+
+bool sd_busy(void)
+{
+    return reading;
+}
+
+uint16_t sd_remaining(void)
+{
+    /* Number of sectors the last read has not delivered */
+    return remaining;
+}
+
+bool sd_read(uint32_t sector, uint8_t *data, uint16_t n)
+{
+    /* Blocking read, resuming with the first sector that failed. This needs
+    the interrupts and so is not available while handling one. */
+    if (__get_IPSR())
+        return false;
+    while (reading);
+
+#if SD_READAHEAD
+    /* Sectors read ahead */
+    while (n && sector >= cached && sector - cached < ncached) {
+        memcpy(data, cache[sector - cached], 512);
+        sector++;
+        data += 512;
+        n--;
+    }
+#endif
+
 #if SD_RETRIES
-        for (uint8_t retry = SD_RETRIES; retry > 0; retry--) {
+    for (uint8_t retry = SD_RETRIES; n && retry > 0; retry--) {
 #else
-        for (;;) {
+    while (n) {
 #endif
-            if (command(CMD_READ_SINGLE_BLOCK, sector) != 0)
-                break;
+        if (!sd_read_async(sector, data, n, 0))
+            return false;
+        while (reading);
+
+        const uint16_t k = n - remaining;
+        sector += k;
+        data += k * 512;
+        n = remaining;
+    }
 
-            if (rxtoken(SD_READ_TIMEOUT) == DATA_TOKEN(DATA_SINGLE_READ)) {
-                if (rxblock(data, 512)) {
-                    select(false);
-                    return true;
-                }
-            }
+    if (n)
+        return false;
 
-            /* Retry */
-            select(false);
-            select(true);
-        }
+#if SD_READAHEAD
+    /* Read ahead unless the next sector is in the cache already */
+    if (open && !(sector >= cached && sector - cached < ncached)) {
+        cached = sector;
+        ncached = 0;
+        ahead = true;
+        done = 0;
+        fetch(cache[0], SD_READAHEAD);
     }
+#endif
 
-    /* Abort */
-    select(false);
-    return false;
+    return true;
 }
 
 bool sd_write(uint32_t sector, const uint8_t *data, uint16_t n)
@@ -688,6 +923,13 @@ bool sd_write(uint32_t sector, const uint8_t *data, uint16_t n)
     if (!n)
         return true;
 
+    /* Drop the read-ahead */
+    if (!await(&ahead))
+        return false;
+#if SD_READAHEAD
+    ncached = 0;
+#endif
+
     if (!high_density)
         sector *= 512;
 
@@ -708,7 +950,7 @@ bool sd_write(uint32_t sector, const uint8_t *data, uint16_t n)
             for (uint16_t i = 0; i < n; i++) {
                 if (ready(SD_WRITE_TIMEOUT)) {
                     txtoken(DATA_TOKEN(DATA_MULTI_WRITE));
-                    txblock(p, 512);
+                    txblock(p, 512, false);
                     if (DATA_RESP_TOKEN(rxtoken(SD_WRITE_TIMEOUT)) == RESP_ACCEPTED) {
                         p += 512;
                         continue;
@@ -746,7 +988,7 @@ bool sd_write(uint32_t sector, const uint8_t *data, uint16_t n)
 
             if (ready(SD_WRITE_TIMEOUT)) {
                 txtoken(DATA_TOKEN(DATA_SINGLE_WRITE));
-                txblock(data, 512);
+                txblock(data, 512, false);
                 if (DATA_RESP_TOKEN(rxtoken(SD_WRITE_TIMEOUT)) == RESP_ACCEPTED) {
                     if (ready(SD_WRITE_TIMEOUT)) {
                         select(false);
@@ -809,6 +1051,83 @@ bool sd_csd(uint8_t *csd)
     }
 }
 
+bool sd_stream(uint32_t sector, uint32_t n)
+{
+    /* Start a multiple block write of up to n sectors, which are pre-erased by
+    the card. The blocks follow by sd_append() and the write is ended by
+    sd_finish(), or by any other access to the card. */
+    if (!await(&ahead))
+        return false;
+#if SD_READAHEAD
+    ncached = 0;
+#endif
+
+    if (!high_density)
+        sector *= 512;
+
+    if (!select(true))
+        return false;
+
+    /* Pre-erasing is a mere hint to the card */
+    if (card_type != SD_MMC)
+        command(ACMD_SET_WR_BLK_ERASE_COUNT, (n < 0x7FFFFF) ? n : 0x7FFFFF);
+
+    if (command(CMD_WRITE_MULTIPLE_BLOCK, sector) != 0) {
+        select(false);
+        return false;
+    }
+
+    writing = true;
+    return true;
+}
+
+bool sd_ready(void)
+{
+    /* Test once whether the card is ready for the next block, without waiting
+    for it to finish programming the last one */
+    if (!writing)
+        return false;
+
+    flush();
+    SPI2->DR = 0xFF;
+    while (!(SPI2->SR & SPI_SR_RXNE));
+    return SPI2->DR == 0xFF;
+}
+
+bool sd_append(uint8_t *data)
+{
+    /* Pass the next block to the running write, once the card is ready. The
+    data is permuted. */
+    if (!writing)
+        return false;
+
+    txtoken(DATA_TOKEN(DATA_MULTI_WRITE));
+    txblock(data, 512, true);
+    if (DATA_RESP_TOKEN(rxtoken(SD_WRITE_TIMEOUT)) == RESP_ACCEPTED)
+        return true;
+
+    /* Abort */
+    sd_finish();
+    return false;
+}
+
+bool sd_finish(void)
+{
+    /* End the running write, waiting for the card to program the last block */
+    if (!writing)
+        return true;
+
+    writing = false;
+    bool ok = ready(SD_WRITE_TIMEOUT);
+    if (ok) {
+        txtoken(DATA_TOKEN(DATA_STOP_TRAN));
+        ok = ready(SD_WRITE_TIMEOUT);
+    }
+
+    select(false);
+    return ok;
+}
+
 bool sd_sync(void)
 {
     if (!select(true))
@@ -854,6 +1173,12 @@ void sd_enable(bool enable)
         GPIOB->BSRR = GPIO_BSRR_BS15;
     }
     else {
+        while (reading);
+        open = false;
+        broken = false;
+#if SD_READAHEAD
+        ncached = 0;
+#endif
         flush();
 
         /* Switch interface to inputs with pull-down */
@@ -1024,7 +1349,7 @@ void sd_prepare(void)
     /* SPI */
     RCC->APB1ENR |= RCC_APB1ENR_SPI2EN;
     __DSB();
-    NVIC_DisableIRQ(SPI2_IRQn);
+    NVIC_EnableIRQ(SPI2_IRQn);
     SPI2->CRCPR = 0x1021;
     SPI2->CR2 = 0;
     SPI2->CR1 =
@@ -1037,7 +1362,7 @@ void sd_prepare(void)
     /* DMA */
     RCC->AHBENR |= RCC_AHBENR_DMA1EN;
     __DSB();
-    NVIC_DisableIRQ(DMA1_Channel4_IRQn);
+    NVIC_EnableIRQ(DMA1_Channel4_IRQn);
     NVIC_DisableIRQ(DMA1_Channel5_IRQn);
     DMA1_Channel4->CPAR = (uint32_t) &SPI2->DR;
     DMA1_Channel4->CCR = 0;
@@ -27,6 +27,12 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define SD_WRITE_TIMEOUT            200
 #define SD_RETRIES                  3
 
+/* Number of sectors read ahead by sd_read() during sequential reads, each
+taking 512 bytes of RAM. Off by default: the scenes prefetch their TPM2 files,
+the only long sequential reads, themselves (see SC_PREFETCH), so sequential
+reads through FatFs only carry on the multiple block read. */
+#define SD_READAHEAD                0
+
 #define SD_HARDWARE_CRC
 
 void sd_enable(bool enable);
@@ -43,8 +49,18 @@ bool sd_csd(uint8_t *csd);
 bool sd_sync(void);
 
 bool sd_read(uint32_t sector, uint8_t *data, uint16_t n);
+
+typedef void (*sd_done_t)(bool ok);
+bool sd_read_async(uint32_t sector, uint8_t *data, uint16_t n, sd_done_t callback);
+bool sd_busy(void);
+uint16_t sd_remaining(void);
 bool sd_write(uint32_t sector, const uint8_t *data, uint16_t n);
 
+bool sd_stream(uint32_t sector, uint32_t n);
+bool sd_ready(void);
+bool sd_append(uint8_t *data);
+bool sd_finish(void);
+
 void sd_prepare(void);
 
 #endif
@@ -45,7 +45,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 static char *volatile pbuf;
 static volatile bool rq;
 
-static void digester(uint32_t status, uint8_t ch)
+static void digester(uint32_t status, const uint8_t *data, size_t n)
 {
     char *p = pbuf;
     if (rq)
@@ -55,9 +55,12 @@ static void digester(uint32_t status, uint8_t ch)
         /* Flush input */
         pbuf = BUF;
         rq = false;
+        return;
     }
-    else {
-        if (pbuf < BUFEND) {
+
+    while (n-- && !rq) {
+        const uint8_t ch = *data++;
+        if (p < BUFEND) {
             if (p > BUF) {
                 /* Detect end of header */
                 if (p[-1] == '\n' && ch == '\n') {
@@ -67,14 +70,14 @@ static void digester(uint32_t status, uint8_t ch)
             }
 
             *p++ = ch;
-            pbuf = p;
         }
         else {
             /* Overflow without end of header */
-            pbuf = BUF;
-            rq = false;
+            p = BUF;
         }
     }
+
+    pbuf = p;
 }
 
 static void flush(void)
@@ -314,6 +317,7 @@ static void helo_request(char *p)
     srv_printf("Software version: %i\n", SOFTWARE_VERSION);
     srv_printf("Vbat: %i\n", ad_vbat());
     srv_printf("Temperature: %i\n", ad_temp());
+    srv_printf("Framerate: %i\n", led_rate());
 
     /* Print UID with fixed length */
     uint32_t uid = sys_uid();
@@ -370,11 +374,16 @@ static void ping_request(char *p)
     /* Send ping */
     uint16_t vbat;
     int16_t rssi, temp;
-    if (hnd_ping(id, &vbat, &rssi, &temp)) {
+    uint8_t depth, reserve;
+    uint16_t underruns;
+    if (hnd_ping(id, &vbat, &rssi, &temp, &depth, &reserve, &underruns)) {
         response(SRV_OK, "Pong");
         srv_printf("Vbat: %i\n", vbat);
         srv_printf("Rssi: %i\n", rssi);
         srv_printf("Temperature: %i\n", temp);
+        srv_printf("Prefetch: %i\n", depth);
+        srv_printf("Reserve: %i\n", reserve);
+        srv_printf("Underruns: %i\n", underruns);
     }
     else {
         response(SRV_NO_NODE, "No node");
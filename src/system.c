@@ -370,6 +370,14 @@ void sys_prepare(void)
     while (!(RTC->CRL & RTC_CRL_RTOFF));
     PWR->CR &= ~PWR_CR_DBP;
 
+    /* Interrupt priorities.
+    Refilling the LED ring has to be done within half of the ring's duration,
+    so it preempts the handlers of the serial port and of the SD card. All
+    others keep a common priority and do not preempt one another. */
+    for (IRQn_Type irq = WWDG_IRQn; irq <= USBWakeUp_IRQn; irq++)
+        NVIC_SetPriority(irq, 1);
+    NVIC_SetPriority(SysTick_IRQn, 1);
+    NVIC_SetPriority(DMA1_Channel2_IRQn, 0);
 
 #ifdef DEBUG
     /* Preserve clocks in stop/sleep modes */
@@ -19,6 +19,21 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 This module decodes TPM2 data according to the specification V1.0 as of 2013,
 to be found at
     http://www.ledstyles.de
+
+Frames received from the serial port are streamed to the LEDs while they are
+being decoded if the maps permit so, see leds.c. Otherwise they are decoded
+into the input buffer and handed over to the maps once complete.
+
+Command blocks are answered over the same line once the decoder has caught on
+to the stream. In acknowledge mode every rendered frame is answered with the
+number of frames that can be received without being skipped, so the host may
+pace its stream instead of having the frames overwrite each other. As the line
+is half-duplex the host must not send anything until the answer is through.
+Commands in files are not answered, only timestamps are taken from them.
+
+The data received may be tapped for recording, see tp2_tap(). The tap is passed
+the data from the interrupt split at the end of every frame, along with whether
+it starts between two blocks.
 */
 
 #include <stdint.h>
@@ -27,6 +42,7 @@ to be found at
 #include "cmsis/stm32f10x.h"
 
 #include "tty.h"
+#include "leds.h"
 #include "buffer.h"
 #include "timeout.h"
 
@@ -34,8 +50,13 @@ to be found at
 
 /* Magic bytes */
 #define TPM2_SER_BLOCK_START_BYTE   0xC9    /* 'NEW BLOCK BYTE' for TPM2.Serial */
+#define TPM2_NET_BLOCK_START_BYTE   0x9C    /* 'NEW BLOCK BYTE' for TPM2.Net */
 #define TPM2_BLOCK_TYPE_DATA        0xDA    /* Block is a  'DATA BLOCK' */
 #define TPM2_BLOCK_TYPE_ZDATA       0xCA
+#define TPM2_BLOCK_TYPE_DDATA       0xCD
+#define TPM2_BLOCK_TYPE_PALETTE     0xCB
+#define TPM2_BLOCK_TYPE_RGB565      0xC5
+#define TPM2_BLOCK_TYPE_RGB444      0xC4
 #define TPM2_BLOCK_TYPE_CMD         0xC0    /* Block is a  'COMMAND BLOCK' */
 #define TPM2_BLOCK_TYPE_ACK         0xAC    /* Block is an 'ANSWER without DATA' (Acknowledge) */
 #define TPM2_BLOCK_TYPE_ACK_DATA    0xAD    /* Block is an 'ANSWER containing DATA' */
@@ -53,14 +74,74 @@ to be found at
 
 So in a continuous sequence of blocks the concatenated values of the end byte
 and the start bytes can actually be used as the block start.
+
+TPM2.Net blocks start with 0x9C instead and carry the packet number, counting
+from 1, and the number of packets of the frame after the block length. The
+packets of a frame are placed one after the other, all but the last one being
+of the same length, and the frame is handed over once all of them are in. A
+lost packet thus costs one frame rather than the alignment of the stream.
 */
 #define TPM2_MAGIC(type) \
     ( ((uint32_t) TPM2_BLOCK_END_BYTE           << 16) | \
       ((uint32_t) TPM2_SER_BLOCK_START_BYTE     <<  8) | \
       ((uint32_t) (type)                        <<  0) )
 
+#define TPM2_NET_MAGIC(type) \
+    ( ((uint32_t) TPM2_BLOCK_END_BYTE           << 16) | \
+      ((uint32_t) TPM2_NET_BLOCK_START_BYTE     <<  8) | \
+      ((uint32_t) (type)                        <<  0) )
+
+/* Delta frames.
+Blocks of type 0xCD encode a frame as a sequence of spans relative to the
+previous frame. Each span starts with a byte holding the kind of span in its
+upper two bits and its length less one in the lower six bits. A length field
+of 63 is followed by two more bytes, the length being 64 plus their value.
+    TPM2_DELTA_COPY              the bytes are those of the previous frame
+    TPM2_DELTA_LITERAL  <bytes>  the bytes follow
+    TPM2_DELTA_MATCH    <d>      the bytes repeat those d+1 bytes before them
+Only the bytes within the length of the previous frame can be copied from it.
+Delta frames are skipped after a frame has been lost, until the next plain or
+RLE frame, so the sender should insert those every now and then.
+*/
+#define TPM2_DELTA_COPY         0
+#define TPM2_DELTA_LITERAL      1
+#define TPM2_DELTA_MATCH        2
+
+/* Compact pixel formats.
+These blocks are expanded to RGB triplets in the input buffer.
+    0xCB  <n> <palette> <indices>  n palette entries of three bytes each, 0
+                                   meaning 256, followed by one index per LED
+    0xC5  <pixels>                 RGB565, two bytes per LED, MSB first
+    0xC4  <pixels>                 RGB444, three bytes per two LEDs, first
+                                   LED in the upper twelve bits
+Palette entries beyond MAXPALETTE and indices beyond the palette are black.
+*/
+#define MAXPALETTE              64
+
+/* Maximum number of packets per frame */
+#define MAXPACKETS              32
+
 #define SHIFT_THRESHOLD         16
 
+/* Commands.
+Command blocks carry the command in their first byte followed by its argument.
+Every command is answered, either by an acknowledge or by an answer containing
+data.
+    TPM2_CMD_ACKNOWLEDGE  <on>   acknowledge rendered frames unless <on> is 0
+    TPM2_CMD_VACANCY             answer the number of free input buffers
+    TPM2_CMD_TIMESTAMP    <t>    time of the following frame in milliseconds,
+                                 four bytes MSB first, see tp2_stamp()
+    TPM2_CMD_GAP          <n>    number of frames dropped so far by a
+                                 recording, four bytes MSB first, ignored
+*/
+#define TPM2_CMD_ACKNOWLEDGE    0x01
+#define TPM2_CMD_VACANCY        0x02
+#define TPM2_CMD_TIMESTAMP      0x03
+#define TPM2_CMD_GAP            0x04
+
+/* Maximum length of a command block */
+#define MAXCMD                  8
+
 const uint32_t baudrates[] = {
     9600,
     19200,
@@ -68,6 +149,7 @@ const uint32_t baudrates[] = {
     57600,
     115200,
     230400,
+    250000,
     460800,
     500000,
 };
@@ -80,9 +162,22 @@ enum {
 
     length0_state,
     length1_state,
+    number_state,
+    count_state,
 
     data_state,
+    command_state,
     repeat_state,
+    delta_state,
+    extent0_state,
+    extent1_state,
+    distance_state,
+    literal_state,
+    colours_state,
+    palette_state,
+    indexed_state,
+    rgb565_state,
+    rgb444_state,
     skip_state,
 
     end_state
@@ -91,6 +186,14 @@ enum {
 
 static uint16_t length;
 static uint16_t index;
+static uint16_t filled;
+static uint16_t soiled;
+static uint16_t offset;
+static uint16_t stride;
+static uint8_t number;
+static uint8_t packets;
+static uint32_t received;
+static bool net;
 static uint32_t ch0;
 static uint32_t ch1;
 static uint8_t state;
@@ -99,7 +202,31 @@ static timeout_t ftimeout;
 
 static volatile bool trip;
 static volatile bool trap;
+static volatile bool queue;
+static bool streaming;
+static bool repeat;
+static bool delta;
+static bool keyed;
+static bool inplace;
+static uint8_t span;
+static uint32_t run;
+static uint8_t entry;
+static uint8_t phase;
+static uint16_t colours;
+static uint8_t palette[MAXPALETTE][3];
+static uint32_t tail;
+static bool command;
+static uint8_t cmd[MAXCMD];
+static uint8_t ncmd;
+static volatile bool ask;
+static volatile bool rendered;
+static bool acknowledge;
+static bool stamped;
+static uint32_t stamp;
+static volatile tp2_tap_t tap;
 static volatile uint8_t shift;
+static bool sensing;
+static bool foreign;
 
 
 #ifdef TPM2_TPZ
@@ -108,26 +235,367 @@ static inline void unroll(uint16_t n)
     /* RLE unrolling.
     Note that this mus be fast enough to take place within the reception of the
     TPM2 data stream, possibly at maximum baud rate.
+    The triplet repeats every three words, so apart from the unaligned head and
+    tail it is stored word by word. */
+    const uint16_t begin = index;
+    const uint16_t m = (n < nbuf) ? n : nbuf;
+    if (begin < m) {
+        const uint8_t t[3] = { wbuf[begin - 3], wbuf[begin - 2], wbuf[begin - 1] };
+        uint8_t k = 0;
+        uint16_t i = begin;
+        uint32_t changed = 0;
+
+        for (; i < m && (i & 3); i++) {
+            changed |= rbuf[i] ^ t[k];
+            wbuf[i] = t[k];
+            k = (k < 2) ? k + 1 : 0;
+        }
 
-        800850c:	f812 1b01 	ldrb.w	r1, [r2], #1
-        8008510:	f803 1b01 	strb.w	r1, [r3], #1
-        8008514:	4298      	cmp	r0, r3
-        8008516:	d3f9      	bcc.n	800850c <digest+0x114>
-    */
-    /*uint8_t *p = &buffer[index - 3];
-    uint8_t *q = &buffer[index];
-    uint8_t *qd = &buffer[index = n];
-    while (qd < q)
-        *q++ = *p++;*/
-    uint8_t *p = &buffer[index - 3];
-    uint8_t *q = &buffer[index];
-    uint8_t *qd = &buffer[index = n];
-    while (q < qd)
-        *q++ = *p++;
+        if (m - i >= 12) {
+            uint32_t w[3];
+            uint8_t *b = (uint8_t *) w;
+            for (uint8_t j = 0; j < 12; j++) {
+                b[j] = t[k];
+                k = (k < 2) ? k + 1 : 0;
+            }
+
+            const uint32_t *r = (const uint32_t *) &rbuf[i];
+            uint32_t *q = (uint32_t *) &wbuf[i];
+            for (; m - i >= 12; i += 12) {
+                changed |= (r[0] ^ w[0]) | (r[1] ^ w[1]) | (r[2] ^ w[2]);
+                q[0] = w[0];
+                q[1] = w[1];
+                q[2] = w[2];
+                r += 3;
+                q += 3;
+            }
+        }
+
+        for (; i < m; i++) {
+            changed |= rbuf[i] ^ t[k];
+            wbuf[i] = t[k];
+            k = (k < 2) ? k + 1 : 0;
+        }
+
+        if (changed)
+            buf_touch(begin, m);
+    }
+
+    if (streaming) {
+        /* Rotate the last triplet through the repeated bytes */
+        uint32_t bytes = ch0 & 0xFFFFFF;
+        for (uint16_t i = begin; i < n; i++) {
+            bytes = ((bytes << 8) | (bytes >> 16)) & 0xFFFFFF;
+            led_stream(i, bytes);
+        }
+    }
+
+    index = n;
 }
 #endif
 
-static bool digest(uint8_t ch)
+static bool busy(void)
+{
+    /* No room for another frame.
+    With a single buffer the frame must have been rendered, with split buffers
+    only a frame that is queued for being handed over blocks the written half. */
+    return (wbuf == rbuf) ? trip : queue;
+}
+
+static uint16_t capacity(void)
+{
+    /* Streamed frames are not limited by the input buffer */
+    return streaming ? MAXFRAME : nbuf;
+}
+
+static void drop(void)
+{
+    /* Release the LEDs of a streamed frame */
+    if (streaming) {
+        streaming = false;
+        led_stream_end();
+    }
+}
+
+static void complete(void)
+{
+    /* Frames split into packets are complete once all packets are in */
+    const uint16_t n = (index < nbuf) ? index : nbuf;
+    if (n > filled)
+        filled = n;
+    if (packets > 1) {
+        received |= 1UL << (number - 1);
+        if (received != (UINT32_MAX >> (32 - packets)))
+            return;
+        received = 0;
+    }
+
+    /* Delta frames may follow once a complete frame is in */
+    if (!delta)
+        keyed = true;
+
+    /* Streamed frames have been rendered already, leaving them in the
+    written half as the base for delta frames */
+    if (streaming) {
+        drop();
+        inplace = true;
+        rendered = true;
+        return;
+    }
+
+    /* Bytes of the written half beyond a shorter frame still hold an older
+    one, take them over from the frame the maps read. The halves then differ
+    only within the frame. */
+    if (wbuf != rbuf) {
+        const uint16_t e = (soiled < nbuf) ? soiled : nbuf;
+        if (filled < e)
+            buf_copy(filled, &rbuf[filled], e - filled);
+    }
+    soiled = filled;
+    filled = 0;
+
+    /* Hand over frame or queue it until the last one has been rendered */
+    inplace = false;
+    if (!trip) {
+        buf_swap();
+        trip = true;
+    }
+    else {
+        queue = true;
+    }
+}
+
+#ifdef TPM2_DELTA
+static uint8_t spanned(void)
+{
+    /* Carry out a span of a delta frame once its header is through.
+    Bytes copied from the previous frame are already in place with a single
+    buffer or after a streamed frame, otherwise they are copied from the read
+    half. */
+    const uint16_t limit = capacity();
+    if (run > (uint32_t) (limit - index))
+        run = limit - index;
+
+    if (span == TPM2_DELTA_COPY) {
+        const uint16_t m = (index + run < nbuf) ? index + run : nbuf;
+        if (wbuf != rbuf && !inplace && index < m)
+            buf_copy(index, &rbuf[index], m - index);
+
+        index += run;
+        return delta_state;
+    }
+    else if (span == TPM2_DELTA_LITERAL) {
+        return literal_state;
+    }
+    else if (span == TPM2_DELTA_MATCH) {
+        return distance_state;
+    }
+
+    keyed = false;
+    return skip_state;
+}
+
+static uint8_t match(uint16_t distance)
+{
+    /* Repeat earlier bytes of the frame, possibly overlapping the span */
+    if (distance > index) {
+        keyed = false;
+        return skip_state;
+    }
+
+    const uint16_t m = (index + run < nbuf) ? index + run : nbuf;
+    if (index < m) {
+        uint32_t changed = 0;
+        for (uint16_t i = index; i < m; i++) {
+            const uint8_t b = wbuf[i - distance];
+            changed |= rbuf[i] ^ b;
+            wbuf[i] = b;
+        }
+
+        if (changed)
+            buf_touch(index, m);
+    }
+
+    index += run;
+    return delta_state;
+}
+
+#endif
+
+#ifdef TPM2_COMPACT
+static void pixel(uint32_t rgb)
+{
+    /* Expand a pixel of a compact block into the input buffer */
+    const uint16_t begin = index;
+    uint32_t changed = 0;
+    for (int8_t shift = 16; shift >= 0 && index < capacity(); shift -= 8) {
+        const uint8_t b = rgb >> shift;
+        if (index < nbuf) {
+            changed |= rbuf[index] ^ b;
+            wbuf[index] = b;
+        }
+
+        tail = (tail << 8) | b;
+        if (streaming)
+            led_stream(index, tail & 0xFFFFFF);
+        index++;
+    }
+
+    if (changed)
+        buf_touch(begin, (index < nbuf) ? index : nbuf);
+}
+
+static inline uint32_t rgb565(uint16_t v)
+{
+    const uint8_t r = (v >> 11) & 0x1F;
+    const uint8_t g = (v >>  5) & 0x3F;
+    const uint8_t b = (v >>  0) & 0x1F;
+    return
+        ((uint32_t) ((r << 3) | (r >> 2)) << 16) |
+        ((uint32_t) ((g << 2) | (g >> 4)) <<  8) |
+        ((uint32_t) ((b << 3) | (b >> 2)) <<  0);
+}
+
+static inline uint32_t rgb444(uint16_t v)
+{
+    /* Replicate the nibbles */
+    return
+        ((uint32_t) (v & 0xF00) * 0x1100) |
+        ((uint32_t) (v & 0x0F0) * 0x0110) |
+        ((uint32_t) (v & 0x00F) * 0x0011);
+}
+#endif
+
+#if defined(TPM2_DELTA) || defined(TPM2_COMPACT)
+static void consume(void)
+{
+    /* Account for a byte of a block that is not decoded byte by byte */
+    if (state == skip_state) {
+        if (!--length)
+            state = end_state;
+    }
+    else if (!--length) {
+        state = end_state;
+        complete();
+    }
+    else if (index >= capacity()) {
+        state = skip_state;
+        complete();
+    }
+}
+#endif
+
+static bool typed(uint8_t type, bool commands)
+{
+    /* Switch block type */
+    repeat = false;
+    command = false;
+    delta = false;
+    entry = data_state;
+
+    switch (type) {
+    case TPM2_BLOCK_TYPE_DATA:
+        return true;
+#ifdef TPM2_TPZ
+    case TPM2_BLOCK_TYPE_ZDATA:
+        repeat = true;
+        return true;
+#endif
+#ifdef TPM2_DELTA
+    case TPM2_BLOCK_TYPE_DDATA:
+        delta = true;
+        entry = delta_state;
+        return true;
+#endif
+#ifdef TPM2_COMPACT
+    case TPM2_BLOCK_TYPE_PALETTE:
+        entry = colours_state;
+        return true;
+    case TPM2_BLOCK_TYPE_RGB565:
+        entry = rgb565_state;
+        return true;
+    case TPM2_BLOCK_TYPE_RGB444:
+        entry = rgb444_state;
+        return true;
+#endif
+    case TPM2_BLOCK_TYPE_CMD:
+        command = true;
+        return commands;
+    default:
+        return false;
+    }
+}
+
+static uint8_t accept(bool live)
+{
+    /* Decide on the block once its header is through. The bytes written by
+    the last one stay in the written half. */
+    if (index > soiled)
+        soiled = index;
+    index = 0;
+    offset = 0;
+    phase = 0;
+    if (command) {
+        ncmd = 0;
+        return length ? command_state : end_state;
+    }
+    else if (!length) {
+        return end_state;
+    }
+
+    /* The frame starts over unless packets of it are in already */
+    if (!received)
+        filled = 0;
+
+    if (packets > 1) {
+        /* Place the packet at its offset in the frame. A packet that is in
+        already starts over with a new frame, giving up the incomplete one.
+        The offset is only known for plain data. */
+        if (!number || number > packets || packets > MAXPACKETS)
+            return skip_state;
+        else if (entry != data_state || repeat)
+            return skip_state;
+
+        if (number < packets)
+            stride = length;
+        else if (!stride)
+            return skip_state;
+
+        if (received & (1UL << (number - 1))) {
+            received = 0;
+            filled = 0;
+            keyed = false;
+        }
+        if (!received && busy()) {
+            keyed = false;
+            return skip_state;
+        }
+
+        const uint32_t o = (uint32_t) stride * (number - 1);
+        offset = (o < nbuf) ? o : nbuf;
+        index = offset;
+        return data_state;
+    }
+    else if (delta) {
+        if (!keyed)
+            return skip_state;
+        if (busy()) {
+            keyed = false;
+            return skip_state;
+        }
+        return delta_state;
+    }
+
+    /* Render live frames as they are received where the maps permit */
+    streaming = live && !trip && led_stream_begin();
+    if (!streaming && busy()) {
+        keyed = false;
+        return skip_state;
+    }
+    return entry;
+}
+
+static bool digest(uint8_t ch, bool live)
 {
     /* Shift register */
     ch0 = (ch0 << 8) | ch;
@@ -135,46 +603,41 @@ static bool digest(uint8_t ch)
 
     switch (state) {
 #ifdef TPM2_TPZ
-    static bool repeat;
     uint16_t n;
 #endif
 
     default:
     case start_state:
-        if (ch == TPM2_SER_BLOCK_START_BYTE)
+        if (ch == TPM2_SER_BLOCK_START_BYTE || ch == TPM2_NET_BLOCK_START_BYTE) {
+            net = (ch == TPM2_NET_BLOCK_START_BYTE);
             state = type_state;
+        }
         break;
 
     case type_state:
-        /* Switch block type */
-#ifdef TPM2_TPZ
-        repeat = false;
-        if (ch == TPM2_BLOCK_TYPE_ZDATA) {
-            state = length0_state;
-            repeat = true;
-        }
-        else
-#endif
-        if (ch == TPM2_BLOCK_TYPE_DATA) {
-            state = length0_state;
-        }
-        else {
-            state = start_state;
-        }
+        state = typed(ch, true) ? length0_state : start_state;
         break;
 
     case length0_state:
         state = length1_state;
         break;
     case length1_state:
-        index = 0;
         length = ch0 & 0xFFFF;
-        if (!length)
-            state = end_state;
-        else if (trip || index >= MAXBUFF)
-            state = skip_state;
+        number = 1;
+        packets = 1;
+        if (net)
+            state = number_state;
         else
-            state = data_state;
+            state = accept(live);
+        break;
+
+    case number_state:
+        number = ch;
+        state = count_state;
+        break;
+    case count_state:
+        packets = ch;
+        state = accept(live);
         break;
 
     case skip_state:
@@ -183,30 +646,46 @@ static bool digest(uint8_t ch)
         break;
 
     case data_state:
-        buffer[index++] = ch0 & 0xFF;
+        if (index < nbuf) {
+            if (rbuf[index] != (ch0 & 0xFF))
+                buf_touch(index, index + 1);
+            wbuf[index] = ch0 & 0xFF;
+        }
+
+        if (streaming)
+            led_stream(index, ch0 & 0xFFFFFF);
+        index++;
+
         if (!--length) {
             state = end_state;
-            trip = true;
+            complete();
         }
-        else if (index >= MAXBUFF) {
+        else if (index >= capacity()) {
             state = skip_state;
-            trip = true;
+            complete();
         }
 #ifdef TPM2_TPZ
         else if (repeat) {
-            if ( index >= 6 && (ch0 & 0xFFFFFF) == (ch1 & 0xFFFFFF) )
+            if ( index >= offset + 6 && (ch0 & 0xFFFFFF) == (ch1 & 0xFFFFFF) )
                 state = repeat_state;
         }
 #endif
         break;
 
+    case command_state:
+        if (ncmd < MAXCMD)
+            cmd[ncmd++] = ch;
+        if (!--length)
+            state = end_state;
+        break;
+
 #ifdef TPM2_TPZ
     case repeat_state:
         n = index + (ch0 & 0xFF) * 3;
-        if (n >= MAXBUFF) {
+        if (n >= capacity()) {
             /* Sanity */
             state = skip_state;
-            n = MAXBUFF;
+            n = capacity();
         }
         else {
             state = data_state;
@@ -221,7 +700,79 @@ static bool digest(uint8_t ch)
         unroll(n);
 
         if (state != data_state)
-            trip = true;
+            complete();
+        break;
+#endif
+
+#ifdef TPM2_DELTA
+    case delta_state:
+        span = ch >> 6;
+        run = (ch & 0x3F) + 1;
+        state = (run > 0x3F) ? extent0_state : spanned();
+        consume();
+        break;
+    case extent0_state:
+        state = extent1_state;
+        consume();
+        break;
+    case extent1_state:
+        run = 64 + (ch0 & 0xFFFF);
+        state = spanned();
+        consume();
+        break;
+    case distance_state:
+        state = match(ch + 1);
+        consume();
+        break;
+
+    case literal_state:
+        if (index < nbuf) {
+            if (rbuf[index] != ch)
+                buf_touch(index, index + 1);
+            wbuf[index] = ch;
+        }
+
+        index++;
+        if (!--run)
+            state = delta_state;
+        consume();
+        break;
+#endif
+
+#ifdef TPM2_COMPACT
+    case colours_state:
+        colours = ch ? ch : 256;
+        run = 0;
+        state = palette_state;
+        consume();
+        break;
+    case palette_state:
+        if (run < sizeof(palette))
+            ((uint8_t *) palette)[run] = ch;
+        if (++run == colours * 3U)
+            state = indexed_state;
+        consume();
+        break;
+    case indexed_state:
+        if (ch < colours && ch < MAXPALETTE)
+            pixel(((uint32_t) palette[ch][0] << 16) | ((uint32_t) palette[ch][1] << 8) | palette[ch][2]);
+        else
+            pixel(0);
+        consume();
+        break;
+
+    case rgb565_state:
+        if ((phase ^= 1) == 0)
+            pixel(rgb565(ch0 & 0xFFFF));
+        consume();
+        break;
+    case rgb444_state:
+        if (phase == 1)
+            pixel(rgb444((ch0 >> 4) & 0xFFF));
+        else if (phase == 2)
+            pixel(rgb444(ch0 & 0xFFF));
+        phase = (phase < 2) ? phase + 1 : 0;
+        consume();
         break;
 #endif
 
@@ -229,7 +780,18 @@ static bool digest(uint8_t ch)
         state = start_state;
         if (ch == TPM2_BLOCK_END_BYTE) {
             trap = true;
-            return true;
+            if (!command)
+                return true;
+
+            if (live) {
+                /* Answered by tp2_answer() */
+                ask = true;
+            }
+            else if (ncmd == 5 && cmd[0] == TPM2_CMD_TIMESTAMP) {
+                stamp = ((uint32_t) cmd[1] << 24) | ((uint32_t) cmd[2] << 16) |
+                        ((uint32_t) cmd[3] <<  8) | ((uint32_t) cmd[4] <<  0);
+                stamped = true;
+            }
         }
 
         break;
@@ -238,54 +800,139 @@ static bool digest(uint8_t ch)
     return false;
 }
 
-static void digester(uint32_t status, uint8_t ch)
+static size_t feed(const uint8_t *data, size_t n, bool live)
 {
-    if (status & (USART_SR_FE | USART_SR_NE)) {
-        length = 0;
-        state = detect_state;
-        if (shift < SHIFT_THRESHOLD)
-            shift++;
-    }
-    else if (state == detect_state) {
-        ch0 = (ch0 << 8) | ch;
-        const uint32_t magic = ch0 & 0xFFFFFF;
-        if ( (magic == TPM2_MAGIC(TPM2_BLOCK_TYPE_DATA))
-#ifdef TPM2_TPZ
-             || (magic == TPM2_MAGIC(TPM2_BLOCK_TYPE_ZDATA))
-#endif
-        ) {
-            /* Count blocks */
-            if (++length == 5) {
-                ftimeout = tot_set(TPM2_FRAME_TIMEOUT);
-                state = length0_state;
-                trip = false;
-                trap = false;
+    const uint8_t *p = data;
+    while (n) {
+        /* Copy the bulk of plain data at once, leaving the last bytes to the
+        decoder for its shift registers and the end of the block */
+        if (state == data_state && !repeat && !streaming) {
+            size_t k = capacity() - index;
+            if (k > length)
+                k = length;
+            if (k > n)
+                k = n;
+
+            if (k > 8) {
+                k -= 8;
+                buf_copy(index, p, k);
+                index += k;
+                length -= k;
+                p += k;
+                n -= k;
             }
         }
+
+        n--;
+        if (digest(*p++, live))
+            break;
+    }
+
+    return p - data;
+}
+
+static void detect(uint8_t ch)
+{
+    ch0 = (ch0 << 8) | ch;
+    const uint32_t magic = ch0 & 0xFFFF00;
+    if ( (magic == TPM2_MAGIC(0) || magic == TPM2_NET_MAGIC(0))
+         && typed(ch, false) ) {
+        /* Count blocks */
+        if (++length == 5) {
+            ftimeout = tot_set(TPM2_FRAME_TIMEOUT);
+            state = length0_state;
+            net = ((ch0 >> 8) & 0xFF) == TPM2_NET_BLOCK_START_BYTE;
+            keyed = false;
+            received = 0;
+            trip = false;
+            trap = false;
+            queue = false;
+        }
     }
-    else {
+}
+
+static void digester(uint32_t status, const uint8_t *data, size_t n)
+{
+    /* An error refers to the last byte */
+    const bool error = status & (USART_SR_FE | USART_SR_NE);
+    if (error && n)
+        n--;
+
+    const tp2_tap_t t = tap;
+    const uint8_t *d = data;
+    while (n && state == detect_state) {
+        detect(*data++);
+        n--;
+    }
+
+    if (t && data != d)
+        (*t)(d, data - d, false);
+
+    if (n) {
         /* Try to align to frames.
         As the TPM2 protocol does not provide any means of frame sync missing
         one single byte in the stream causes infinite misalignment. By catching
         on a short interruption in the stream this can be re-aligned, provided
         that the sender actually inserts the interruption. */
-        if (tot_expired(ftimeout))
+        if (tot_expired(ftimeout)) {
+            if (state != start_state)
+                keyed = false;
+            drop();
             state = start_state;
+        }
 
-        if (status & USART_SR_RXNE) {
-            ftimeout = tot_set(TPM2_FRAME_TIMEOUT);
-            digest(ch);
+        while (n) {
+            const bool aligned = (state == start_state);
+            const size_t k = feed(data, n, true);
+            if (t)
+                (*t)(data, k, aligned);
+            data += k;
+            n -= k;
         }
+
+        ftimeout = tot_set(TPM2_FRAME_TIMEOUT);
+    }
+
+    if (error) {
+        drop();
+        length = 0;
+        state = detect_state;
+        if (shift < SHIFT_THRESHOLD)
+            shift++;
     }
 }
 
 void tp2_enable(bool enable)
 {
+    if (!enable)
+        tty_hook(0);
+
     tp2_reset();
-    if (enable)
+    if (enable) {
         tty_hook(&digester);
-    else
-        tty_hook(0);
+
+        /* Sense the baud rate right away */
+        timeout = tot_set(0);
+        tty_sense();
+        sensing = true;
+    }
+}
+
+static uint8_t nearest(uint32_t baud)
+{
+    /* Baud rate with the least relative deviation */
+    uint8_t best = 0;
+    uint32_t least = UINT32_MAX;
+    for (uint8_t i = 0; i < sizeof(baudrates)/sizeof(*baudrates); i++) {
+        const uint32_t d = (baud > baudrates[i]) ? baud - baudrates[i] : baudrates[i] - baud;
+        const uint32_t e = d / (baudrates[i] >> 8);
+        if (e < least) {
+            least = e;
+            best = i;
+        }
+    }
+
+    return best;
 }
 
 bool tp2_detect(void)
@@ -300,16 +947,32 @@ bool tp2_detect(void)
             return true;
     }
 
-    /* Try another baud rate */
-    if (++index >= sizeof(baudrates)/sizeof(*baudrates))
-        index = 0;
-    tty_baud(baudrates[index]);
+    /* Sense the baud rate of the source rather than trying one after the
+    other */
+    uint32_t baud;
+    bool brk;
+    if (!sensing) {
+        tty_sense();
+        sensing = true;
+    }
+    else if (tty_sensed(&baud, &brk)) {
+        sensing = false;
+        foreign = brk;
+        tty_baud(baudrates[nearest(baud)]);
+
+        timeout = tot_set(TPM2_TIMEOUT);
+        shift = 0;
+    }
 
-    timeout = tot_set(TPM2_TIMEOUT);
-    shift = 0;
     return false;
 }
 
+bool tp2_dmx(void)
+{
+    /* DMX breaks have been sensed on the line */
+    return foreign;
+}
+
 bool tp2_trip(void)
 {
     return trip;
@@ -317,27 +980,131 @@ bool tp2_trip(void)
 
 void tp2_clear(void)
 {
-    trip = false;
+    /* Hand over a frame that has been completed in the meantime */
+    __disable_irq();
+    if (queue) {
+        queue = false;
+        buf_swap();
+    }
+    else {
+        trip = false;
+    }
+    rendered = true;
+    __enable_irq();
 }
 
-size_t tp2_digest(const uint8_t *data, size_t n)
+static uint8_t vacancy(void)
 {
-    const uint8_t *p = data;
-    while (n--) {
-        if (digest(*p++))
+    /* Number of frames that can be received without being skipped */
+    if (streaming)
+        return 1;
+    else if (wbuf == rbuf)
+        return trip ? 0 : 1;
+    else if (queue)
+        return 0;
+    else
+        return trip ? 1 : 2;
+}
+
+static void answer(uint8_t type, const uint8_t *data, uint8_t n)
+{
+    uint8_t block[4 + MAXCMD + 1];
+    if (n > MAXCMD)
+        n = MAXCMD;
+
+    block[0] = TPM2_SER_BLOCK_START_BYTE;
+    block[1] = type;
+    block[2] = 0;
+    block[3] = n;
+    for (uint8_t i = 0; i < n; i++)
+        block[4 + i] = data[i];
+    block[4 + n] = TPM2_BLOCK_END_BYTE;
+
+    tty_write(block, 4 + n + 1);
+}
+
+void tp2_answer(void)
+{
+    /* Answer commands and acknowledge rendered frames.
+    This blocks while the transceiver is turned around, so it must not be
+    called from interrupt context. The answers are held back until the line
+    has been quiet for a moment, so a frame sent right after a command is not
+    cut off. */
+    if (!tot_expired(ftimeout))
+        return;
+
+    if (ask) {
+        ask = false;
+
+        uint8_t n;
+        switch (ncmd ? cmd[0] : 0) {
+        case TPM2_CMD_ACKNOWLEDGE:
+            acknowledge = (ncmd < 2) || cmd[1];
+            answer(TPM2_BLOCK_TYPE_ACK, 0, 0);
+            break;
+
+        case TPM2_CMD_VACANCY:
+            n = vacancy();
+            answer(TPM2_BLOCK_TYPE_ACK_DATA, &n, 1);
             break;
+
+        default:
+            answer(TPM2_BLOCK_TYPE_ACK, 0, 0);
+            break;
+        }
     }
 
-    return p - data;
+    if (rendered) {
+        rendered = false;
+        if (acknowledge) {
+            const uint8_t n = vacancy();
+            answer(TPM2_BLOCK_TYPE_ACK_DATA, &n, 1);
+        }
+    }
+}
+
+size_t tp2_digest(const uint8_t *data, size_t n)
+{
+    return feed(data, n, false);
+}
+
+bool tp2_stamp(uint32_t *t)
+{
+    /* Timestamp digested since the last call */
+    if (!stamped)
+        return false;
+
+    stamped = false;
+    *t = stamp;
+    return true;
+}
+
+void tp2_tap(tp2_tap_t t)
+{
+    tap = t;
 }
 
 void tp2_reset(void)
 {
+    drop();
     ch0 = 0;
     ch1 = 0;
+    packets = 1;
+    received = 0;
+    filled = 0;
+    soiled = nbuf;
+    keyed = false;
+    inplace = false;
     trip = false;
     trap = false;
+    queue = false;
     shift = 0;
+    sensing = false;
+    foreign = false;
+    ask = false;
+    rendered = false;
+    acknowledge = false;
+    stamped = false;
 
     timeout = tot_set(TPM2_TIMEOUT);
     state = detect_state;
@@ -25,15 +25,25 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define TPM2_TIMEOUT                1000
 #define TPM2_FRAME_TIMEOUT          4
 #define TPM2_TPZ
+#define TPM2_DELTA
+#define TPM2_COMPACT
 
 size_t tp2_digest(const uint8_t *buf, size_t length);
+bool tp2_stamp(uint32_t *t);
+
+/* Taps receive the data of the serial port from interrupt context, split at the
+end of every frame, aligned being set if the data starts between two blocks */
+typedef void (*tp2_tap_t)(const uint8_t *data, size_t n, bool aligned);
+void tp2_tap(tp2_tap_t t);
 
 void tp2_baud(uint32_t baud);
 void tp2_enable(bool enable);
 bool tp2_detect(void);
+bool tp2_dmx(void);
 
 bool tp2_trip(void);
 void tp2_clear(void);
+void tp2_answer(void);
 void tp2_reset(void);
 
 void tp2_prepare(void);
@@ -16,6 +16,25 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 /** UART input and output.
+Received data is written by DMA1 channel 5 to a ring in circular mode. The half
+transfer and transfer complete interrupts of the channel, as well as the idle
+line and error interrupts of the UART, pass the data received so far on to the
+hook in batches. This takes two interrupts per ring instead of one per byte.
+DMA1 channel 5 is shared with the transmission to the SD card, which therefore
+suspends the reception by DMA with tty_dma(). In the meantime the data is
+received byte by byte by the receive interrupt.
+Hooks may also direct the reception into a linear buffer of their own with
+tty_direct(), so the data is received in place. The hook is then called once
+the buffer is full, or on an error or an idle line before.
+Bytes that arrive before the last one has been read are lost. These overruns
+are counted, see tty_overruns().
+
+The bit time of an unknown source is sensed by Timer 1 from the edges on the
+receive line PA10, which captures the rising edges on channel 3 and the falling
+edges on channel 4. The shortest of TTYSENSE pulses is taken as the bit time.
+A low pulse longer than ten bit times cannot occur in UART frames and is taken
+as a DMX break. The timer runs at 72MHz, its overflows are counted to tell long
+pulses apart.
 */
 
 #include <stdint.h>
@@ -30,6 +49,23 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "tty.h"
 
 static volatile tty_hook_t hook;
+static volatile bool dma;
+
+static uint8_t ring[TTYRING];
+static uint8_t *base;
+static uint16_t size;
+static uint16_t tail;
+static volatile uint16_t overruns;
+
+static volatile uint8_t edges;
+static volatile uint32_t shortest;
+static volatile uint32_t longest;
+static uint16_t last;
+static uint8_t wraps;
+
+#if TTYRING & (TTYRING - 1)
+#   error Ring size must be a power of two
+#endif
 
 static uint16_t brr(uint32_t baud)
 {
@@ -88,20 +124,198 @@ static void txen(bool tx)
 }
 
 
-static void sentinel(uint32_t status, uint8_t ch)
+static void sentinel(uint32_t status, const uint8_t *data, size_t n)
 {
     (void) status;
-    (void) ch;
+    (void) data;
+    (void) n;
     /* vakat */
 }
 
+static void arm(uint8_t *data, uint16_t n)
+{
+    /* Receive into the ring in circular mode or into a linear buffer */
+    DMA1_Channel5->CCR = 0;
+    DMA1_Channel5->CPAR = (uint32_t) &USART1->DR;
+    DMA1_Channel5->CMAR = (uint32_t) data;
+    DMA1_Channel5->CNDTR = n;
+    DMA1->IFCR = DMA_IFCR_CGIF5;
+    __DSB();
+
+    base = data;
+    size = n;
+    tail = 0;
+    if (data == ring)
+        DMA1_Channel5->CCR =
+            DMA_CCR5_MINC |
+            DMA_CCR5_CIRC |
+            DMA_CCR5_HTIE |
+            DMA_CCR5_TCIE |
+            DMA_CCR5_EN;
+    else
+        DMA1_Channel5->CCR =
+            DMA_CCR5_MINC |
+            DMA_CCR5_TCIE |
+            DMA_CCR5_EN;
+}
+
+static void drain(uint32_t status)
+{
+    /* Pass the data received since the last call on to the hook, in two pieces
+    if the ring has wrapped around. The hook may re-arm the reception. */
+    const uint8_t *b = base;
+    const uint16_t head = size - DMA1_Channel5->CNDTR;
+    uint16_t t = tail;
+    if (head < t) {
+        tail = 0;
+        (*hook)(USART_SR_RXNE, &b[t], size - t);
+        if (base != b)
+            return;
+        t = 0;
+    }
+
+    tail = head;
+    if (head > t || (status & (USART_SR_FE | USART_SR_NE)))
+        (*hook)(status, &b[t], head - t);
+}
+
 void USART1_IRQHandler(void) __USED;
 void USART1_IRQHandler(void)
 {
-    /* Clear status flags and interrupt request */
+    /* Clear status flags and interrupt request by reading the data register.
+    A byte that is pending there belongs to the DMA, which clears the flags by
+    reading it in turn. */
     const uint32_t status = USART1->SR;
-    const uint8_t ch = USART1->DR;
-    (*hook)(status, ch);
+    if (status & USART_SR_ORE)
+        overruns++;
+
+    if (dma) {
+        if (!(status & USART_SR_RXNE))
+            (void) USART1->DR;
+        drain(status | USART_SR_RXNE);
+    }
+    else {
+        const uint8_t ch = USART1->DR;
+        (*hook)(status, &ch, (status & USART_SR_RXNE) ? 1 : 0);
+    }
+}
+
+void DMA1_Channel5_IRQHandler(void) __USED;
+void DMA1_Channel5_IRQHandler(void)
+{
+    /* Half transfer or transfer complete */
+    DMA1->IFCR = DMA_IFCR_CGIF5;
+    drain(USART_SR_RXNE);
+}
+
+static void edge(uint16_t t, bool low, bool valid)
+{
+    /* Width of the pulse that has just ended. A width that is off by an
+    overflow is always too long. */
+    const uint32_t width = ((uint32_t) wraps << 16) + t - last;
+    last = t;
+    wraps = 0;
+
+    if (edges++ && valid) {
+        if (width < shortest)
+            shortest = width;
+        if (low && width > longest)
+            longest = width;
+    }
+
+    if (edges >= TTYSENSE) {
+        TIM1->DIER = 0;
+        TIM1->CR1 &= ~TIM_CR1_CEN;
+    }
+}
+
+void TIM1_UP_IRQHandler(void) __USED;
+void TIM1_UP_IRQHandler(void)
+{
+    TIM1->SR = ~TIM_SR_UIF;
+    if (wraps < UINT8_MAX)
+        wraps++;
+}
+
+void TIM1_CC_IRQHandler(void) __USED;
+void TIM1_CC_IRQHandler(void)
+{
+    const uint16_t sr = TIM1->SR;
+    TIM1->SR = ~(TIM_SR_CC3IF | TIM_SR_CC4IF | TIM_SR_CC3OF | TIM_SR_CC4OF);
+
+    /* Pulses adjacent to a missed edge are not measured */
+    const bool valid = !(sr & (TIM_SR_CC3OF | TIM_SR_CC4OF));
+    const uint16_t rise = TIM1->CCR3;
+    const uint16_t fall = TIM1->CCR4;
+    if ((sr & TIM_SR_CC3IF) && (sr & TIM_SR_CC4IF)) {
+        /* Both edges, earlier one first */
+        if ((uint16_t) (rise - last) < (uint16_t) (fall - last)) {
+            edge(rise, true, valid);
+            edge(fall, false, valid);
+        }
+        else {
+            edge(fall, false, valid);
+            edge(rise, true, valid);
+        }
+    }
+    else if (sr & TIM_SR_CC3IF) {
+        /* A rising edge terminates a low pulse */
+        edge(rise, true, valid);
+    }
+    else if (sr & TIM_SR_CC4IF) {
+        edge(fall, false, valid);
+    }
+}
+
+void tty_sense(void)
+{
+    /* Measure the next TTYSENSE pulses on the receive line */
+    NVIC_DisableIRQ(TIM1_CC_IRQn);
+    NVIC_DisableIRQ(TIM1_UP_IRQn);
+    TIM1->CR1 = 0;
+    TIM1->DIER = 0;
+
+    edges = 0;
+    wraps = 0;
+    shortest = UINT32_MAX;
+    longest = 0;
+
+    TIM1->PSC = 0;
+    TIM1->ARR = 0xFFFF;
+    TIM1->CCMR2 =
+        TIM_CCMR2_CC3S_0 |
+        TIM_CCMR2_CC4S_1;
+    TIM1->CCER =
+        TIM_CCER_CC3E |
+        TIM_CCER_CC4E |
+        TIM_CCER_CC4P;
+    TIM1->EGR = TIM_EGR_UG;
+    TIM1->SR = 0;
+    TIM1->DIER = TIM_DIER_CC3IE | TIM_DIER_CC4IE | TIM_DIER_UIE;
+    TIM1->CR1 = TIM_CR1_CEN;
+    __DSB();
+
+    NVIC_EnableIRQ(TIM1_CC_IRQn);
+    NVIC_EnableIRQ(TIM1_UP_IRQn);
+}
+
+bool tty_sensed(uint32_t *baud, bool *brk)
+{
+    /* Bit rate and break once enough pulses have been measured */
+    if (edges < TTYSENSE)
+        return false;
+
+    NVIC_DisableIRQ(TIM1_CC_IRQn);
+    NVIC_DisableIRQ(TIM1_UP_IRQn);
+    if (shortest == UINT32_MAX) {
+        /* No pulse has been measured reliably, try again */
+        tty_sense();
+        return false;
+    }
+
+    *baud = 72000000 / shortest;
+    *brk = longest > 10 * shortest;
+    return true;
 }
 
 void tty_baud(uint32_t baud)
@@ -112,15 +326,78 @@ void tty_baud(uint32_t baud)
     USART1->CR1 |= USART_CR1_UE;
 }
 
+bool tty_dma(bool enable)
+{
+    /* Switch between reception by DMA and by the receive interrupt, returning
+    the previous state */
+    const bool enabled = dma;
+    NVIC_DisableIRQ(USART1_IRQn);
+    NVIC_DisableIRQ(DMA1_Channel5_IRQn);
+    if (enable && !enabled) {
+        arm(ring, TTYRING);
+        USART1->CR3 |= USART_CR3_DMAR | USART_CR3_EIE;
+        USART1->CR1 = (USART1->CR1 & ~USART_CR1_RXNEIE) | USART_CR1_IDLEIE;
+        dma = true;
+    }
+    else if (!enable && enabled) {
+        /* Stop requests, then pass on what is left in the ring. Bytes that
+        arrive in the meantime are left to the receive interrupt. */
+        USART1->CR3 &= ~(USART_CR3_DMAR | USART_CR3_EIE);
+        __DSB();
+        drain(USART_SR_RXNE);
+
+        DMA1_Channel5->CCR = 0;
+        DMA1->IFCR = DMA_IFCR_CGIF5;
+        USART1->CR1 = (USART1->CR1 & ~USART_CR1_IDLEIE) | USART_CR1_RXNEIE;
+        dma = false;
+    }
+    __DSB();
+
+    if (hook != sentinel) {
+        NVIC_EnableIRQ(USART1_IRQn);
+        if (dma)
+            NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+    }
+
+    return enabled;
+}
+
+bool tty_direct(uint8_t *data, uint16_t n)
+{
+    /* Receive the next n bytes into data, or into the ring again if data is
+    null. Only from within the hook, and only if DMA is available. */
+    if (!dma)
+        return false;
+
+    if (data)
+        arm(data, n);
+    else
+        arm(ring, TTYRING);
+    return true;
+}
+
+uint16_t tty_overruns(void)
+{
+    /* Number of receiver overruns since the last call, each losing a byte at
+    least */
+    __disable_irq();
+    uint16_t n = overruns;
+    overruns = 0;
+    __enable_irq();
+    return n;
+}
+
 void tty_hook(tty_hook_t h)
 {
     if (h) {
         NVIC_DisableIRQ(USART1_IRQn);
+        NVIC_DisableIRQ(DMA1_Channel5_IRQn);
         hook = h;
         __DSB();
-        NVIC_EnableIRQ(USART1_IRQn);
+        tty_dma(true);
     }
     else {
+        tty_dma(false);
         NVIC_DisableIRQ(USART1_IRQn);
         hook = sentinel;
         __DSB();
@@ -163,6 +440,16 @@ void tty_putchar(char c)
     txen(false);
 }
 
+void tty_write(const uint8_t *data, size_t n)
+{
+    txen(true);
+    while (n--) {
+        while (!(USART1->SR & USART_SR_TXE));
+        USART1->DR = *data++;
+    }
+    txen(false);
+}
+
 void tty_prepare(void)
 {
     /* Port */
@@ -180,6 +467,19 @@ void tty_prepare(void)
     GPIOA->CRH |= GPIO_CRH_CNF9_1 | GPIO_CRH_MODE9_1;
     GPIOA->ODR |= GPIO_ODR_ODR9;
 
+    /* DMA */
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+    __DSB();
+    NVIC_DisableIRQ(DMA1_Channel5_IRQn);
+
+    /* Timer for sensing the bit time */
+    RCC->APB2ENR |= RCC_APB2ENR_TIM1EN;
+    __DSB();
+    NVIC_DisableIRQ(TIM1_CC_IRQn);
+    NVIC_DisableIRQ(TIM1_UP_IRQn);
+    TIM1->CR1 = 0;
+    TIM1->DIER = 0;
+
     /* USART */
     RCC->APB2ENR |= RCC_APB2ENR_USART1EN;
     __DSB();
@@ -193,5 +493,6 @@ void tty_prepare(void)
     USART1->BRR = brr(9600);
 
     hook = &sentinel;
+    dma = false;
 }
 
@@ -24,11 +24,26 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #define TTYBUFF             128
 
-typedef void (*tty_hook_t)(uint32_t status, uint8_t ch);
+/* Size of the receive ring, a power of two */
+#define TTYRING             256
+
+/* Hooks receive the data in batches, status refers to the last byte. A batch
+may be empty if an error is reported. */
+typedef void (*tty_hook_t)(uint32_t status, const uint8_t *data, size_t n);
 void tty_hook(tty_hook_t h);
+bool tty_dma(bool enable);
+bool tty_direct(uint8_t *data, uint16_t n);
+uint16_t tty_overruns(void);
+
+/* Number of pulses to sense the bit time from */
+#define TTYSENSE            64
+
+void tty_sense(void);
+bool tty_sensed(uint32_t *baud, bool *brk);
 
 void tty_puts(const char *buf);
 void tty_putchar(char c);
+void tty_write(const uint8_t *data, size_t n);
 
 void tty_baud(uint32_t baud);
 void tty_enable(bool enable);